@@ -1,3 +1,7 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mempool.h>
+
 #include "comm_buf.h"
 
 
@@ -10,3 +14,58 @@ void fillbuf_get_attr_value(struct smartio_comm_buf *buf, int fcn, int attr, int
     smartio_write_16bit(buf, 2, attr);
     buf->data[4] = array;
 }
+EXPORT_SYMBOL_GPL(fillbuf_get_attr_value);
+
+
+/* Comm buffers come from their own slab cache. A mempool keeps a
+   reserve, so the request path does not fail under memory pressure. */
+#define COMM_BUF_RESERVE 16
+
+static struct kmem_cache *comm_buf_cache;
+static mempool_t *comm_buf_pool;
+
+
+int smartio_comm_buf_init(void)
+{
+  comm_buf_cache = KMEM_CACHE(smartio_comm_buf, 0);
+  if (!comm_buf_cache)
+    return -ENOMEM;
+
+  comm_buf_pool = mempool_create_slab_pool(COMM_BUF_RESERVE, comm_buf_cache);
+  if (!comm_buf_pool) {
+    kmem_cache_destroy(comm_buf_cache);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+
+void smartio_comm_buf_exit(void)
+{
+  mempool_destroy(comm_buf_pool);
+  kmem_cache_destroy(comm_buf_cache);
+}
+
+
+/* Returns a zeroed buffer. Owned by the caller until passed on to
+   smartio_free_comm_buf() */
+struct smartio_comm_buf *smartio_alloc_comm_buf(gfp_t gfp)
+{
+  struct smartio_comm_buf *buf = mempool_alloc(comm_buf_pool, gfp);
+
+  if (buf) {
+    memset(buf, 0, sizeof *buf);
+    INIT_LIST_HEAD(&buf->list);
+    buf->prio = SMARTIO_PRIO_NORMAL;
+  }
+  return buf;
+}
+EXPORT_SYMBOL_GPL(smartio_alloc_comm_buf);
+
+
+void smartio_free_comm_buf(struct smartio_comm_buf *buf)
+{
+  if (buf)
+    mempool_free(buf, comm_buf_pool);
+}
+EXPORT_SYMBOL_GPL(smartio_free_comm_buf);
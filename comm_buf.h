@@ -2,6 +2,8 @@
 #define __SMARTIO_COMM_BUF__
 
 #include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
 
 enum smartio_cmds {
   SMARTIO_GET_NO_OF_MODULES = 1,
@@ -10,12 +12,59 @@ enum smartio_cmds {
   SMARTIO_GET_ATTR_VALUE,
   SMARTIO_SET_ATTR_VALUE,
   SMARTIO_GET_STRING,
+  SMARTIO_GET_MULTI,
+  SMARTIO_SET_MULTI,
+  SMARTIO_GET_DESC_HASH,
 };
 
+/* Multi-value commands are sent to module 0 and carry several
+   (module, attr, array) tuples in one frame.
+   GET_MULTI request: count, then per tuple: module, attr (16 bit), array
+   GET_MULTI response: status, count, then per answered tuple:
+                       status, len, value (len bytes)
+   SET_MULTI request: count, then per tuple: module, attr (16 bit), array,
+                      len, value (len bytes)
+   SET_MULTI response: status, count, then one status per handled tuple
+   The node answers as many tuples as fit in the response, in order;
+   the host sends the rest in the next frame. */
+#define SMARTIO_MULTI_HDR_SIZE 3 /* module + command + count */
+#define SMARTIO_MULTI_TUPLE_SIZE 4 /* module + attr ix + array ix */
+
+/* GET_STRING reads a string or table of a module in chunks. A node
+   answers each request with one frame, so a table takes one request
+   per chunk; all but the first are queued at once.
+   Request: module, command, string id (16 bit), offset (16 bit)
+   Response: status, total length (16 bit), then the bytes from offset
+             on, as many as fit in the frame
+   String SMARTIO_STRING_ATTR_TABLE is the attribute table of the module,
+   with one record per attribute: flags, array size, type, name and
+   ending NUL. */
+#define SMARTIO_STRING_ATTR_TABLE 0
+#define SMARTIO_STRING_REQ_SIZE 6 /* module + command + id + offset */
+#define SMARTIO_STRING_HDR_SIZE 3 /* status + total length */
+
+/* GET_DESC_HASH is sent to module 0. The response is status and a
+   32 bit hash of all module and attribute definitions of the node,
+   most significant byte first. 0 means the node has no hash. */
+#define SMARTIO_DESC_HASH_RESP_SIZE 5
+
 #define SMARTIO_DATA_SIZE 31
 
+/* Priority classes of the node queues, highest first */
+enum smartio_prio {
+  SMARTIO_PRIO_CONTROL, /* Writes of outputs and setpoints */
+  SMARTIO_PRIO_NORMAL,  /* Attribute reads and introspection */
+  SMARTIO_PRIO_BULK,    /* Stream polling */
+  SMARTIO_NR_PRIOS
+};
+
 struct smartio_comm_buf;
+struct smartio_node;
+struct smartio_merged_write;
 
+/* resp is NULL if the request failed; req->status then tells why.
+   Called with the io lock of the node held, so it must not wait for
+   another request; see smartio_submit_request(). */
 typedef void (*smartio_tx_completion_cb)(struct smartio_comm_buf *req,
 					 struct smartio_comm_buf *resp,
 					 void *data);
@@ -24,6 +73,18 @@ struct smartio_comm_buf {
   struct list_head list;
   void *cb_data;
   smartio_tx_completion_cb cb;
+  struct completion done; /* Signalled when a blocking request completes */
+  struct smartio_node *node;
+  struct hrtimer timer; /* Deadline of the outstanding request */
+  int retries; /* Resends left before the request fails */
+  int status; /* 0, or -ETIMEDOUT if the node never responded */
+  bool queued; /* Waiting in the node queue, not yet sent */
+  uint8_t prio; /* enum smartio_prio */
+  /* Set for combinable writes; points back at the slot naming the
+     queued write, so it can be cleared once the write is sent */
+  struct smartio_comm_buf **pending_ref;
+  /* Writers whose values were merged into this write wait here */
+  struct smartio_merged_write *merged;
   uint8_t data_len;
   uint8_t msg_type;
   uint8_t transport_header;
@@ -69,6 +130,11 @@ int smartio_get_transaction_id(struct smartio_comm_buf* buf);
 
 void fillbuf_get_attr_value(struct smartio_comm_buf *buf, int fcn, int attr, int array);
 
+int smartio_comm_buf_init(void);
+void smartio_comm_buf_exit(void);
+struct smartio_comm_buf *smartio_alloc_comm_buf(gfp_t gfp);
+void smartio_free_comm_buf(struct smartio_comm_buf *buf);
+
 int smartio_read_16bit(struct smartio_comm_buf* buf, int ofs);
 void smartio_write_16bit(struct smartio_comm_buf* buf, int ofs, int val);
 
@@ -1,31 +1,25 @@
 #include <linux/mutex.h>
-#include <linux/bitops.h>
+#include <linux/idr.h>
+#include <linux/rcupdate.h>
 
 #include "minor_id.h"
 
-#define NO_OF_BITS 256
-
-static DECLARE_BITMAP(minorId, NO_OF_BITS);
+/* Maps minor numbers to their owners. Updates are serialized by the
+   mutex; lookups only need rcu_read_lock(). */
+static DEFINE_IDR(minorId);
 static DEFINE_MUTEX(lock);
 
 
-int get_minor_number(void)
+int get_minor_number(void *owner)
 {
   int newId;
 
   mutex_lock(&lock);
-  newId = find_first_zero_bit(minorId, NO_OF_BITS);
+  newId = idr_alloc(&minorId, owner, 0, SMARTIO_MINORS, GFP_KERNEL);
+  mutex_unlock(&lock);
 
-  if (newId == NO_OF_BITS)
-  {
+  if (newId < 0)
     pr_err("There are no free minor number IDs\n");
-    newId = -1;
-    goto done;
-  }
-  set_bit(newId, minorId);
-
- done:
-  mutex_unlock(&lock);
   return newId;
 }
 
@@ -34,10 +28,24 @@ int release_minor_number(int id)
   int status = id;
 
   mutex_lock(&lock);
-  if (!test_and_clear_bit(id, minorId)) {
+  if (!idr_find(&minorId, id)) {
     pr_err("Failed to release unclaimed minor number %d\n", id);
     status = -1;
   }
+  else
+    idr_remove(&minorId, id);
   mutex_unlock(&lock);
   return status;
 }
+
+/* Call under rcu_read_lock(). The owner must be pinned by other
+   means before leaving the read side section. */
+void *find_minor_owner(int id)
+{
+  return idr_find(&minorId, id);
+}
+
+void minor_id_exit(void)
+{
+  idr_destroy(&minorId);
+}
@@ -1,7 +1,14 @@
 #ifndef __SMARTIO_MINOR_ID_H__
 #define __SMARTIO_MINOR_ID_H__
 
-int get_minor_number(void);
+#include <linux/kdev_t.h>
+
+/* Size of the char device region */
+#define SMARTIO_MINORS (MINORMASK + 1)
+
+int get_minor_number(void *owner);
 int release_minor_number(int id);
+void *find_minor_owner(int id);
+void minor_id_exit(void);
 
 #endif
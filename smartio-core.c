@@ -2,11 +2,26 @@
 #include <linux/module.h>
 #include <linux/sched.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/kref.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/idr.h>
 #include <linux/kdev_t.h>
 #include <linux/fs.h>
-#include <linux/kfifo.h>
+#include <linux/cdev.h>
+#include <linux/rcupdate.h>
+#include <linux/async.h>
+#include <linux/semaphore.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
 #include <linux/ctype.h>
+#include <linux/firmware.h>
+#include <linux/version.h>
 #include <asm-generic/uaccess.h>
 
 #include "smartio.h"
@@ -14,21 +29,71 @@
 #include "convert.h"
 #include "txbuf_list.h"
 #include "minor_id.h"
+#include "smartio_ring.h"
 
-struct smartio_devread_work;
-#define DEV_FIFO_SIZE 128
+struct smartio_stream;
 
 #define DBG_TRANS
 
-/* Char device major number */
-static int major;
-/* Serialize these two ops:
-   1) find currently highest device id on the bus
-   2) register the new device
-*/
-static DEFINE_MUTEX(id_lock);
+/* Char device region; minors are handed out by minor_id.c */
+static dev_t smartio_devt;
+static struct file_operations char_dev_fops;
+
+/* Default number of outstanding requests per node */
+static int window = 4;
+module_param(window, int, 0644);
+MODULE_PARM_DESC(window, "Max outstanding requests per node (1-8)");
+
+/* Retry policy for requests the node does not respond to */
+static unsigned int timeout_ms = 500;
+module_param(timeout_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_ms, "Time to wait for a response before resending");
+static unsigned int retries = 2;
+module_param(retries, uint, 0644);
+MODULE_PARM_DESC(retries, "Number of resends before a request fails");
+
+static bool direct_submit = true;
+module_param(direct_submit, bool, 0644);
+MODULE_PARM_DESC(direct_submit, "Send from the calling thread when the node is idle");
+
+/* A queued request is passed over by higher priority ones at most
+   this many times before it is sent anyway */
+static unsigned int starve_limit = 8;
+module_param(starve_limit, uint, 0644);
+MODULE_PARM_DESC(starve_limit, "Max times a lower priority request is passed over");
+
+static unsigned int cache_max_age_ms;
+module_param(cache_max_age_ms, uint, 0644);
+MODULE_PARM_DESC(cache_max_age_ms, "Default lifetime of cached attribute values, 0 disables");
+
+static bool desc_download = true;
+module_param(desc_download, bool, 0644);
+MODULE_PARM_DESC(desc_download, "Read attribute tables with GET_STRING during probe");
+
+static bool desc_cache = true;
+module_param(desc_cache, bool, 0644);
+MODULE_PARM_DESC(desc_cache, "Reuse the descriptors of nodes with a known descriptor hash");
+
+static unsigned int ring_pages = 4;
+module_param(ring_pages, uint, 0644);
+MODULE_PARM_DESC(ring_pages, "Size of the ring of a char device reader, in pages (1-1024)");
+
+/* Instance numbers. Nodes are numbered by node_ida, and functions by
+   one IDA per function name, so adc0, adc1 and dac0 can coexist.
+   The IDAs of function names are kept until the module is removed. */
+static DEFINE_IDA(node_ida);
+
+struct smartio_fcn_ids {
+  struct hlist_node node;
+  struct ida ida;
+  char name[SMARTIO_NAME_SIZE+1];
+};
+
+static DEFINE_HASHTABLE(fcn_ids, 5);
+static DEFINE_MUTEX(fcn_ids_lock);
 
-static void free_groups(struct attribute_group** groups);
+struct smartio_fcn_type;
+static void smartio_put_fcn_type(struct smartio_fcn_type *t);
 
 struct dev_attr_info {
   bool isInput; /* Present in user space or sysfs for udev to set rw flags */
@@ -41,8 +106,12 @@ struct fcn_dev {
   int function_ix;
   struct device dev;
   struct dev_attr_info devattr;  
-  DECLARE_KFIFO_PTR(fifo, uint8_t);
-  struct smartio_devread_work *devread_work;  
+  unsigned int cache_max_age_ms; /* Default attribute cache lifetime */
+  struct smartio_fcn_type *fcn_type; /* Shared sysfs groups */
+  struct fcn_attr_state *attr_state;
+  const char *type_name; /* Function name, without instance number */
+  struct ida *ida; /* Which dev.id came from */
+  struct cdev cdev; /* Holds a reference to dev while open */
 };
 
 static void smartio_node_release(struct device *dev)
@@ -53,6 +122,7 @@ static void smartio_node_release(struct device *dev)
   node = container_of(dev, struct smartio_node, dev);
 #endif
   dev_warn(dev, "Releasing smartio node\n");
+  ida_simple_remove(&node_ida, node->dev.id);
 #if 1
   kfree(node);
 #else
@@ -73,25 +143,141 @@ static struct device_type function_devt = {
 };
 #endif
 
+static ssize_t window_show(struct device *dev,
+			   struct device_attribute *attr,
+			   char *buf)
+{
+  return scnprintf(buf, PAGE_SIZE, "%d\n", to_node(dev)->transactions.window);
+}
+
+static void smartio_kick_tx(struct smartio_node *node);
+static bool smartio_queue_work(struct smartio_node *node,
+			       struct kthread_work *work);
+
+static ssize_t window_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf,
+			    size_t count)
+{
+  struct smartio_node *node = to_node(dev);
+  int val;
+
+  if (kstrtoint(buf, 0, &val) || (val < 1) || (val > TRANS_ID_BITS))
+    return -EINVAL;
+  smartio_set_window(&node->transactions, val);
+  /* A larger window may let queued requests go */
+  smartio_kick_tx(node);
+  return count;
+}
+
+#if (VERSION>=3) && (PATCHLEVEL>10)
+static DEVICE_ATTR_RW(window);
+#else
+struct device_attribute dev_attr_window = __ATTR(window, 0644, window_show, window_store);
+#endif
+struct attribute *controller_attrs[] = {
+  &dev_attr_window.attr,
+  NULL
+};
+
+#if (VERSION>=3) && (PATCHLEVEL>10)
+ATTRIBUTE_GROUPS(controller);
+#else
+static const struct attribute_group controller_group = {
+  .attrs = controller_attrs,
+};
+static const struct attribute_group *controller_groups[] = {
+  &controller_group,
+  NULL,
+};
+#endif
+
 static struct device_type controller_devt = {
   .name = "smartio_controller",
+  .groups = controller_groups,
   .release = smartio_node_release
 };
 
+/* Driver matching. The id_table names of all registered drivers are
+   hashed, so a match is one lookup of the device's type name. */
+struct smartio_id_entry {
+  struct hlist_node node;
+  struct device_driver *drv;
+  const char *name;
+};
+
+static DEFINE_HASHTABLE(smartio_ids, 6);
+static DEFINE_SPINLOCK(smartio_ids_lock);
+
+/* What drivers match on: the function name, or for nodes the bus
+   dev_name, both without the instance number */
+static const char *smartio_type_name(struct device *dev)
+{
+  if (dev->type == &controller_devt)
+    return smartio_bus.dev_name;
+  return container_of(dev, struct fcn_dev, dev)->type_name;
+}
+
 int smartio_match(struct device* dev, struct device_driver* drv)
 {
-  struct smartio_driver* driver = to_smartio_driver(drv);
-  const struct smartio_device_id* drv_id;
+  const char *name = smartio_type_name(dev);
+  struct smartio_id_entry *entry;
+  int match = 0;
 
-  dev_info(dev, "Matching device %s to driver %s\n", dev_name(dev), drv->name);  
-  for(drv_id = driver->id_table; drv_id->name != NULL; drv_id++) {
-    if (!strncmp(dev_name(dev), drv_id->name, strlen(drv_id->name))) {
-      dev_info(dev, "Match of %s succeeded\n", drv_id->name);
-      return 1;
+  if (!name)
+    return 0;
+  spin_lock(&smartio_ids_lock);
+  hash_for_each_possible(smartio_ids, entry, node,
+			 jhash(name, strlen(name), 0))
+    if ((entry->drv == drv) && !strcmp(entry->name, name)) {
+      match = 1;
+      break;
     }
-    else {
-      dev_info(dev, "No match for %s\n", drv_id->name);
+  spin_unlock(&smartio_ids_lock);
+  return match;
+}
+
+static int smartio_uevent(struct device *dev, struct kobj_uevent_env *env)
+{
+  const char *name = smartio_type_name(dev);
+
+  if (name && add_uevent_var(env, "MODALIAS=smartio:%s", name))
+    return -ENOMEM;
+  return 0;
+}
+
+static void smartio_del_ids(struct device_driver *drv)
+{
+  struct smartio_id_entry *entry;
+  struct hlist_node *tmp;
+  int bkt;
+
+  spin_lock(&smartio_ids_lock);
+  hash_for_each_safe(smartio_ids, bkt, tmp, entry, node)
+    if (entry->drv == drv) {
+      hash_del(&entry->node);
+      kfree(entry);
+    }
+  spin_unlock(&smartio_ids_lock);
+}
+
+static int smartio_add_ids(struct smartio_driver *sd)
+{
+  const struct smartio_device_id* drv_id;
+  struct smartio_id_entry *entry;
+
+  for (drv_id = sd->id_table; drv_id->name != NULL; drv_id++) {
+    entry = kzalloc(sizeof *entry, GFP_KERNEL);
+    if (!entry) {
+      smartio_del_ids(&sd->driver);
+      return -ENOMEM;
     }
+    entry->drv = &sd->driver;
+    entry->name = drv_id->name;
+    spin_lock(&smartio_ids_lock);
+    hash_add(smartio_ids, &entry->node,
+	     jhash(entry->name, strlen(entry->name), 0));
+    spin_unlock(&smartio_ids_lock);
   }
   return 0;
 }
@@ -103,8 +289,11 @@ static void function_release(struct device* dev)
 
 	dev_info(dev, "Smartio function release called\n");	
 	fcn = container_of(dev, struct fcn_dev, dev);
-	free_groups((struct attribute_group**) dev->groups);
-	kfree(dev->groups);
+	if (fcn->fcn_type)
+		smartio_put_fcn_type(fcn->fcn_type);
+	if (fcn->ida)
+		ida_simple_remove(fcn->ida, dev->id);
+	kfree(fcn->attr_state);
 	kfree(fcn);
 }
 
@@ -112,6 +301,7 @@ struct  bus_type smartio_bus = {
   .name = "smartio",
   .dev_name = "smartio_bus_master",
   .match = smartio_match,
+  .uevent = smartio_uevent,
 };
 
 static struct class smartio_function_class = {
@@ -125,20 +315,99 @@ struct fcn_attribute {
   struct device_attribute dev_attr;
   int attr_ix;
   int type;
+  int arr_size; /* Elements, if more than one */
+};
+
+/* Per function state of an attribute, indexed by attr_ix. The
+   fcn_attribute itself is shared by all functions of the same type. */
+struct fcn_attr_state {
+  /* Last value read. Served to readers until it is max_age_ms old;
+     max_age_ms < 0 means use the default of the function. */
+  spinlock_t cache_lock;
+  bool cache_valid;
+  unsigned int cache_gen; /* Bumped by writes, to drop reads in flight */
+  unsigned long cached_at;
+  int cache_len;
+  u8 cache[SMARTIO_DATA_SIZE];
+  int max_age_ms;
+  /* Last writer wins: a newer value replaces a queued, unsent write.
+     pending_set is protected by the tx lock of the node. */
+  bool combine_writes;
+  struct smartio_comm_buf *pending_set;
 };
 
-// The workqueue used for all smartio work
-static struct workqueue_struct *work_queue;
+/* Each node has its own worker thread, so a slow node does not hold
+   up the others, and the work of a node runs one item at a time, in
+   the order queued. It lives while the controller driver is bound.
+   The thread is named smartio<id>, so its CPU affinity and priority
+   can be set per node with taskset and chrt. */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0)
+#define kthread_init_work init_kthread_work
+#define kthread_queue_work queue_kthread_work
+
+static struct kthread_worker *smartio_create_worker(int id)
+{
+  struct kthread_worker *worker = kzalloc(sizeof(*worker), GFP_KERNEL);
+  struct task_struct *task;
+
+  if (!worker)
+    return ERR_PTR(-ENOMEM);
+  init_kthread_worker(worker);
+  task = kthread_run(kthread_worker_fn, worker, "smartio%d", id);
+  if (IS_ERR(task)) {
+    kfree(worker);
+    return ERR_CAST(task);
+  }
+  return worker;
+}
+
+static void smartio_destroy_worker(struct kthread_worker *worker)
+{
+  flush_kthread_worker(worker);
+  kthread_stop(worker->task);
+  kfree(worker);
+}
+#else
+static struct kthread_worker *smartio_create_worker(int id)
+{
+  return kthread_create_worker(0, "smartio%d", id);
+}
+
+static void smartio_destroy_worker(struct kthread_worker *worker)
+{
+  kthread_destroy_worker(worker);
+}
+#endif
 
 struct smartio_work {
-  struct work_struct work;
+  struct kthread_work work;
   struct smartio_comm_buf *comm_buf;
   struct smartio_node* node; 
 };
 
-struct smartio_devread_work {
+/* Work items for indications, with a reserve like the comm buffers */
+#define WORK_RESERVE 8
+static struct kmem_cache *work_cache;
+static mempool_t *work_pool;
+
+/* One open of a function char device. Readers get a ring, see
+   smartio_ring.h, which the node is polled into. The stream lives
+   until it is closed and no poll request is outstanding. */
+struct smartio_stream {
+  struct kref ref;
+  struct fcn_dev *fcn_dev;
   struct delayed_work work;
-  struct fcn_dev* fcn_dev; 
+  wait_queue_head_t wait; /* Readers waiting for data */
+  void *ring; /* Header page, tail page, then the data */
+  struct smartio_ring_hdr *hdr;
+  struct smartio_ring_tail *tail;
+  uint8_t *data;
+  /* The ring as the driver knows it. User space may map the shared
+     pages, so they are only written, never trusted. */
+  u32 size;
+  u32 head;
+  u32 overruns;
 };
 
 struct smartio_indication_work {
@@ -146,62 +415,74 @@ struct smartio_indication_work {
   struct smartio_comm_buf *comm_buf;
 };
 
-static DECLARE_WAIT_QUEUE_HEAD(wait_queue);
-
-
-static void handle_response(struct smartio_comm_buf *resp)
+static void handle_response(struct smartio_node *node,
+			    struct smartio_comm_buf *resp)
 {
   struct smartio_comm_buf *req;
 
   pr_info("Entering handle_response\n");
 
-  req = smartio_find_transaction(smartio_get_transaction_id(resp));
+  req = smartio_find_transaction(node, smartio_get_transaction_id(resp));
 
   if (req) {
+	unsigned long flags;
+
+	/* The deadline may have passed already; the request is then
+	   on the expired list, which it must leave. */
+	hrtimer_cancel(&req->timer);
+	spin_lock_irqsave(&node->tx_lock, flags);
+	list_del_init(&req->list);
+	spin_unlock_irqrestore(&node->tx_lock, flags);
+
+	req->status = 0;
 	req->cb(req, resp, req->cb_data);
-	wake_up_interruptible(&wait_queue);
+	/* A slot in the window was freed */
+	smartio_kick_tx(node);
   }
 }
 
-static void wq_fcn_handle_indication(struct work_struct *w)
+static void wq_fcn_handle_indication(struct kthread_work *w)
 {
   struct smartio_work *my_work = container_of(w, struct smartio_work, work);
 
 #ifdef DBG_TRANS
   pr_info("HAOD: indication work function\n");
 #endif
-  handle_response(my_work->comm_buf);
-  kfree(my_work->comm_buf);
-  kfree(my_work);
+  mutex_lock(&my_work->node->io_lock);
+  handle_response(my_work->node, my_work->comm_buf);
+  mutex_unlock(&my_work->node->io_lock);
+  smartio_free_comm_buf(my_work->comm_buf);
+  mempool_free(my_work, work_pool);
 }
 
 
 void handle_indication(struct smartio_node *node, struct smartio_comm_buf *ind)
 {
-  struct smartio_work *my_work = kmalloc(sizeof *my_work, GFP_KERNEL);
+  struct smartio_work *my_work = mempool_alloc(work_pool, GFP_KERNEL);
   int status;
 
   pr_info("Entering handle_indication\n");
 
   if (!my_work) {
     dev_err(&node->dev, "No memory for work item\n");
+    smartio_free_comm_buf(ind);
     return;
   }
 
-  INIT_WORK(&my_work->work, wq_fcn_handle_indication);
+  kthread_init_work(&my_work->work, wq_fcn_handle_indication);
   my_work->comm_buf = ind;
   my_work->node = node;
 #ifdef DBG_WORK
   pr_info("Before queueing indication work\n");
 #endif
-  status = queue_work(work_queue, &my_work->work);
+  status = smartio_queue_work(node, &my_work->work);
 #ifdef DBG_WORK
   pr_info("After queueing indication work\n");
 #endif
   if (!status) {
     dev_err(&node->dev, "Failed to queue work\n");
-    kfree(my_work->node);
-    kfree(my_work);
+    smartio_free_comm_buf(ind);
+    mempool_free(my_work, work_pool);
     return;
   }
 }
@@ -215,6 +496,7 @@ static int talk_to_node(struct smartio_node *node,
   struct smartio_comm_buf rx;
   int status;
 
+  rx.data_len = 0;
   dev_warn(&node->dev, "About to call communicate\n");
   status = node->communicate(node, tx, &rx);
   dev_warn(&node->dev, "Call to communicate done\n");
@@ -225,7 +507,7 @@ static int talk_to_node(struct smartio_node *node,
     switch (msg_type) {
     case SMARTIO_RESPONSE:
       dev_info(&node->dev, "Got a response message\n");
-      handle_response(&rx);
+      handle_response(node, &rx);
       break;
     case SMARTIO_REQUEST:
     case SMARTIO_ACKNOWLEDGED:
@@ -241,80 +523,390 @@ static int talk_to_node(struct smartio_node *node,
 }
 
 
-static void wq_fcn_post_message(struct work_struct *w)
+static void smartio_arm_deadline(struct smartio_comm_buf *buf)
 {
-  struct smartio_work *my_work = container_of(w, struct smartio_work, work);
+  hrtimer_start(&buf->timer,
+		ktime_set(timeout_ms / MSEC_PER_SEC,
+			  (timeout_ms % MSEC_PER_SEC) * NSEC_PER_MSEC),
+		HRTIMER_MODE_REL);
+}
 
-#ifdef DBG_TRANS
-  pr_info("HAOD: request work function\n");
-#endif
-  smartio_add_transaction(my_work->comm_buf);
-  talk_to_node(my_work->node, my_work->comm_buf);
-  pr_info("HAOD: talk to node done\n");
-  kfree(my_work);
-  pr_info("HAOD: freed work function\n");
+
+/* Called with the tx lock held */
+static bool smartio_tx_pending(struct smartio_node *node)
+{
+  int prio;
+
+  for (prio = 0; prio < SMARTIO_NR_PRIOS; prio++)
+    if (!list_empty(&node->tx_queue[prio]))
+      return true;
+  return false;
+}
+
+
+/* Take a request off its queue. A combined write stops accepting
+   newer values from here on. Called with the tx lock held. */
+static void smartio_unlist_request(struct smartio_comm_buf *buf)
+{
+  list_del_init(&buf->list);
+  buf->queued = false;
+  if (buf->pending_ref) {
+    if (*buf->pending_ref == buf)
+      *buf->pending_ref = NULL;
+    buf->pending_ref = NULL;
+  }
+}
+
+
+/* Pick the priority class to send from next: the highest one with
+   queued requests, unless a lower one has been passed over
+   starve_limit times. Called with the tx lock held. */
+static int smartio_pick_prio(struct smartio_node *node)
+{
+  int prio;
+  int chosen = -1;
+
+  for (prio = SMARTIO_NR_PRIOS - 1; prio >= 0; prio--) {
+    if (list_empty(&node->tx_queue[prio]))
+      continue;
+    chosen = prio;
+    if (node->tx_passed[prio] >= starve_limit)
+      break;
+  }
+  return chosen;
+}
+
+
+/* Take the next queued request of the node and give it a transaction
+   ID. Returns NULL when the queue is empty or the window is full. */
+static struct smartio_comm_buf *smartio_next_request(struct smartio_node *node)
+{
+  struct smartio_comm_buf *buf = NULL;
+  unsigned long flags;
+  int chosen;
+
+  spin_lock_irqsave(&node->tx_lock, flags);
+  chosen = smartio_pick_prio(node);
+  if (chosen >= 0) {
+    buf = list_first_entry(&node->tx_queue[chosen], struct smartio_comm_buf, list);
+    if (smartio_add_transaction(node, buf) < 0)
+      buf = NULL;
+    else {
+      int prio;
+
+      smartio_unlist_request(buf);
+      smartio_arm_deadline(buf);
+      for (prio = 0; prio < SMARTIO_NR_PRIOS; prio++) {
+	if (prio == chosen)
+	  node->tx_passed[prio] = 0;
+	else if (!list_empty(&node->tx_queue[prio]))
+	  node->tx_passed[prio]++;
+      }
+    }
+  }
+  spin_unlock_irqrestore(&node->tx_lock, flags);
+
+  return buf;
+}
+
+
+/* Queue work on the node worker, unless the node is going away */
+static bool smartio_queue_work(struct smartio_node *node,
+			       struct kthread_work *work)
+{
+  unsigned long flags;
+  bool queued = false;
+
+  spin_lock_irqsave(&node->tx_lock, flags);
+  if (node->online)
+    queued = kthread_queue_work(node->worker, work);
+  spin_unlock_irqrestore(&node->tx_lock, flags);
+
+  return queued;
+}
+
+
+/* Runs in hrtimer context. The expired request is only handed over
+   to the node work, which reclaims it in process context. */
+static enum hrtimer_restart smartio_request_timeout(struct hrtimer *t)
+{
+  struct smartio_comm_buf *req = container_of(t, struct smartio_comm_buf, timer);
+  struct smartio_node *node = req->node;
+  unsigned long flags;
+
+  spin_lock_irqsave(&node->tx_lock, flags);
+  list_add_tail(&req->list, &node->tx_expired);
+  if (node->online)
+    kthread_queue_work(node->worker, &node->tx_work);
+  spin_unlock_irqrestore(&node->tx_lock, flags);
+
+  return HRTIMER_NORESTART;
+}
+
+
+/* Free the transaction IDs of expired requests. Each one is resent
+   first in the queue, or failed with -ETIMEDOUT when out of retries. */
+static void smartio_reclaim_expired(struct smartio_node *node)
+{
+  struct smartio_comm_buf *req;
+  unsigned long flags;
+
+  spin_lock_irqsave(&node->tx_lock, flags);
+  while (!list_empty(&node->tx_expired)) {
+    req = list_first_entry(&node->tx_expired, struct smartio_comm_buf, list);
+    list_del_init(&req->list);
+    spin_unlock_irqrestore(&node->tx_lock, flags);
+
+    /* Let the timer callback finish before reusing the request */
+    hrtimer_cancel(&req->timer);
+    if (smartio_remove_transaction(node, req)) {
+      if (req->retries > 0) {
+	req->retries--;
+	dev_warn(&node->dev, "Request timed out, resending\n");
+	spin_lock_irqsave(&node->tx_lock, flags);
+	list_add(&req->list, &node->tx_queue[req->prio]);
+	req->queued = true;
+	spin_unlock_irqrestore(&node->tx_lock, flags);
+      }
+      else {
+	dev_err(&node->dev, "Request timed out\n");
+	req->status = -ETIMEDOUT;
+	req->cb(req, NULL, req->cb_data);
+      }
+    }
+
+    spin_lock_irqsave(&node->tx_lock, flags);
+  }
+  spin_unlock_irqrestore(&node->tx_lock, flags);
 }
 
 
-static int transaction_done(struct smartio_comm_buf *buf)
+/* Send queued requests until the queue is empty or the window is full.
+   Responses may arrive in any order; they are matched by ID in
+   handle_response(), which restarts this work as slots free up. */
+static void wq_fcn_tx(struct kthread_work *w)
 {
+  struct smartio_node *node = container_of(w, struct smartio_node, tx_work);
+  struct smartio_comm_buf *buf;
+
 #ifdef DBG_TRANS
-  pr_info("HAOD: wakeup cond is %s\n",
-	  (smartio_get_direction(buf) == SMARTIO_FROM_NODE) ?
-	  "FROM_NODE" : "TO_NODE");
+  pr_info("HAOD: request work function\n");
 #endif
-  return smartio_get_direction(buf) == SMARTIO_FROM_NODE;
+  mutex_lock(&node->io_lock);
+  smartio_reclaim_expired(node);
+  while ((buf = smartio_next_request(node)) != NULL)
+    talk_to_node(node, buf);
+  mutex_unlock(&node->io_lock);
 }
 
 
-static void request_completion_cb(struct smartio_comm_buf *req,
-				  struct smartio_comm_buf *resp,
-				  void *data)
+static void smartio_kick_tx(struct smartio_node *node)
 {
-  req->data_len = resp->data_len;
-  memcpy(req->data, resp->data, resp->data_len);
-  pr_info("Copied %d bytes from resp to req\n", req->data_len);
-  /* Swapping the direction tells waiter it needs to sleep
-     no more. */
-  smartio_set_direction(req, SMARTIO_FROM_NODE);
+  unsigned long flags;
+
+  spin_lock_irqsave(&node->tx_lock, flags);
+  if (node->online && smartio_tx_pending(node))
+    kthread_queue_work(node->worker, &node->tx_work);
+  spin_unlock_irqrestore(&node->tx_lock, flags);
 }
 
 
-static int post_request(struct smartio_node* node,
-			struct smartio_comm_buf* buf)
+/* Fail every request of a node going away with -ENODEV, queued or
+   outstanding. No new requests are taken from here on. */
+static void smartio_fail_requests(struct smartio_node *node)
 {
-  struct smartio_work *my_work;
-  int status;
+  struct smartio_comm_buf *req, *tmp;
+  unsigned long flags;
+  LIST_HEAD(failed);
+  int prio;
+
+  mutex_lock(&node->io_lock);
+  spin_lock_irqsave(&node->tx_lock, flags);
+  node->online = false;
+  for (prio = 0; prio < SMARTIO_NR_PRIOS; prio++)
+    list_for_each_entry_safe(req, tmp, &node->tx_queue[prio], list) {
+      smartio_unlist_request(req);
+      list_add_tail(&req->list, &failed);
+    }
+  spin_unlock_irqrestore(&node->tx_lock, flags);
+
+  while ((req = smartio_take_transaction(node)) != NULL) {
+    /* Its deadline may have passed; then it is on the expired list */
+    hrtimer_cancel(&req->timer);
+    spin_lock_irqsave(&node->tx_lock, flags);
+    list_del_init(&req->list);
+    spin_unlock_irqrestore(&node->tx_lock, flags);
+    list_add_tail(&req->list, &failed);
+  }
+
+  list_for_each_entry_safe(req, tmp, &failed, list) {
+    list_del_init(&req->list);
+    req->status = -ENODEV;
+    req->cb(req, NULL, req->cb_data);
+  }
+  mutex_unlock(&node->io_lock);
+}
+
 
+static void smartio_prepare_request(struct smartio_node *node,
+				    struct smartio_comm_buf *buf)
+{
   // Set the transaction header
   smartio_set_msg_type(buf, SMARTIO_REQUEST);
   smartio_set_direction(buf, SMARTIO_TO_NODE);
-  buf->cb = request_completion_cb;
 
+  buf->node = node;
+  if (buf->prio >= SMARTIO_NR_PRIOS)
+    buf->prio = SMARTIO_PRIO_NORMAL;
+  buf->retries = retries;
+  buf->status = 0;
+  hrtimer_init(&buf->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  buf->timer.function = smartio_request_timeout;
+}
 
-  // Post deferred work
-  my_work = kmalloc(sizeof *my_work, GFP_KERNEL);
-  if (!my_work) {
-    dev_err(&node->dev, "No memory for work item\n");
-    return -ENOMEM;
+
+/* Returns -ENODEV if the node is going away */
+static int smartio_enqueue_request(struct smartio_node *node,
+				   struct smartio_comm_buf *buf)
+{
+  unsigned long flags;
+  int status = -ENODEV;
+
+  spin_lock_irqsave(&node->tx_lock, flags);
+  if (node->online) {
+    list_add_tail(&buf->list, &node->tx_queue[buf->prio]);
+    buf->queued = true;
+    if (buf->pending_ref)
+      *buf->pending_ref = buf;
+    kthread_queue_work(node->worker, &node->tx_work);
+    status = 0;
   }
+  spin_unlock_irqrestore(&node->tx_lock, flags);
 
-  INIT_WORK(&my_work->work, wq_fcn_post_message);
-  my_work->comm_buf = buf;
-  my_work->node = node;
-#ifdef DBG_WORK
-  pr_info("Before queueing work\n");
-#endif
-  status = queue_work(work_queue, &my_work->work);
-#ifdef DBG_WORK
-  pr_info("After queueing work\n");
-#endif
-  if (!status) {
-    pr_err("Failed to queue work\n");
-    kfree(my_work);
-    return -ENOMEM; // TBD better error code
+  return status;
+}
+
+
+static int smartio_queue_request(struct smartio_node *node,
+				 struct smartio_comm_buf *buf)
+{
+  smartio_prepare_request(node, buf);
+  return smartio_enqueue_request(node, buf);
+}
+
+
+/* Send a request from the calling thread, skipping the trip through
+   the node worker. Only done when nothing else is waiting to be
+   sent and nobody is talking to the node; otherwise returns false and
+   the request has to be queued. The caller must be able to sleep. */
+static bool smartio_submit_direct(struct smartio_node *node,
+				  struct smartio_comm_buf *buf)
+{
+  unsigned long flags;
+  bool sent = false;
+
+  might_sleep();
+  if (!direct_submit || !mutex_trylock(&node->io_lock))
+    return false;
+
+  spin_lock_irqsave(&node->tx_lock, flags);
+  if (node->online && !smartio_tx_pending(node) &&
+      list_empty(&node->tx_expired) &&
+      (smartio_add_transaction(node, buf) >= 0)) {
+    smartio_arm_deadline(buf);
+    sent = true;
+  }
+  spin_unlock_irqrestore(&node->tx_lock, flags);
+
+  if (sent)
+    talk_to_node(node, buf);
+  mutex_unlock(&node->io_lock);
+
+  return sent;
+}
+
+
+/* Queue a request without waiting for it. cb is called once with the
+   response, or with a NULL response and buf->status set if the
+   request failed. cb runs in the node worker, or in a thread sending
+   directly to the node, with the io lock of the node held. It may
+   submit further requests, but must not issue a blocking one: that
+   waits for the worker, which needs the io lock. The buffer belongs to the core
+   until cb is called; after that it belongs to cb. Requests still
+   pending when the node goes away fail with -ENODEV.
+   Returns -ENODEV if the node is already going away; cb is then not
+   called, and the buffer stays with the caller. */
+int smartio_submit_request(struct smartio_node *node,
+			   struct smartio_comm_buf *buf,
+			   smartio_tx_completion_cb cb,
+			   void *data)
+{
+  if (!cb)
+    return -EINVAL;
+
+  buf->cb = cb;
+  buf->cb_data = data;
+  return smartio_queue_request(node, buf);
+}
+EXPORT_SYMBOL_GPL(smartio_submit_request);
+
+
+/* Take back a request which has not been sent yet.
+   Returns false if the request is already outstanding, or other
+   writers wait for it; cb will then still be called. */
+bool smartio_cancel_request(struct smartio_node *node,
+			    struct smartio_comm_buf *buf)
+{
+  bool queued = false;
+  unsigned long flags;
+
+  spin_lock_irqsave(&node->tx_lock, flags);
+  if (buf->queued && !buf->merged) {
+    smartio_unlist_request(buf);
+    queued = true;
+  }
+  spin_unlock_irqrestore(&node->tx_lock, flags);
+
+  return queued;
+}
+EXPORT_SYMBOL_GPL(smartio_cancel_request);
+
+
+static void request_completion_cb(struct smartio_comm_buf *req,
+				  struct smartio_comm_buf *resp,
+				  void *data)
+{
+  if (resp) {
+    req->data_len = resp->data_len;
+    memcpy(req->data, resp->data, resp->data_len);
+    pr_info("Copied %d bytes from resp to req\n", req->data_len);
+  }
+  else
+    req->data_len = 0;
+  /* Wake the one thread waiting for this request */
+  complete(&req->done);
+}
+
+
+/* Send a request and wait for the answer, resending it up to
+   resends times if the node does not answer in time */
+static int post_request_resends(struct smartio_node* node,
+				struct smartio_comm_buf* buf,
+				int resends)
+{
+  int status;
+
+  buf->cb = request_completion_cb;
+  init_completion(&buf->done);
+  smartio_prepare_request(node, buf);
+  buf->retries = resends;
+  if (!smartio_submit_direct(node, buf)) {
+    status = smartio_enqueue_request(node, buf);
+    if (status)
+      return status;
   }
-  status = wait_event_interruptible(wait_queue, transaction_done(buf));
+
+  status = wait_for_completion_interruptible(&buf->done);
   if (status == 0) {
 #ifdef DBG_WORK
     pr_info("Woke up after request\n");
@@ -322,8 +914,18 @@ static int post_request(struct smartio_node* node,
   }
   else {
     pr_info("Received a signal\n");
+    if (smartio_cancel_request(node, buf))
+      return status;
+    /* Already sent; it completes, at the latest, when out of retries */
+    wait_for_completion(&buf->done);
   }
-  return status;
+  return buf->status;
+}
+
+static int post_request(struct smartio_node* node,
+			struct smartio_comm_buf* buf)
+{
+  return post_request_resends(node, buf, retries);
 }
 
 
@@ -333,7 +935,7 @@ int smartio_get_no_of_modules(struct smartio_node* node, char *name)
   struct smartio_comm_buf* buf;
   int status;
 
-  buf = kzalloc(sizeof *buf, GFP_KERNEL);
+  buf = smartio_alloc_comm_buf(GFP_KERNEL);
   if (!buf) 
     return -ENOMEM;
 
@@ -342,53 +944,40 @@ int smartio_get_no_of_modules(struct smartio_node* node, char *name)
   buf->data[1] = SMARTIO_GET_NO_OF_MODULES;
   status = post_request(node, buf);
   if (status < 0)
-    return status;
+    goto free_buf;
 
-  if (buf->data_len <= 3)
-    return -ENOMEM; // TBD: err to indicate wrong data size
+  if (buf->data_len <= 3) {
+    status = -ENOMEM; // TBD: err to indicate wrong data size
+    goto free_buf;
+  }
   strncpy(name, buf->data+3, SMARTIO_NAME_SIZE);
   name[SMARTIO_NAME_SIZE] = '\0';
   
-  return smartio_read_16bit(buf, 1);
+  status = smartio_read_16bit(buf, 1);
+
+ free_buf:
+  smartio_free_comm_buf(buf);
+  return status;
 }
 EXPORT_SYMBOL(smartio_get_no_of_modules);
 
 
 
-static int smartio_get_function_info(struct smartio_node* node, 
-				     int module,
-				     int *no_of_attrs,
-				     char *name)
+/* Decode the response to SMARTIO_GET_NO_OF_ATTRIBUTES */
+static int smartio_parse_function_info(struct smartio_comm_buf *buf,
+				       int *no_of_attrs,
+				       char *name)
 {
-  struct smartio_comm_buf* buf;
-  int status;
-
-  buf = kzalloc(sizeof *buf, GFP_KERNEL);
-  if (!buf) 
-    return -ENOMEM;
-
-  buf->data_len = 2; // module + command
-  buf->data[0] = module;
-  buf->data[1] = SMARTIO_GET_NO_OF_ATTRIBUTES;
-  status = post_request(node, buf);
-  if (status < 0) {
-    dev_err(&node->dev, "DARN DARN DARN\n");
-    return status;
-  }
-
-  if (buf->data_len <= 3) {
-    dev_err(&node->dev, "DARN DARN DARN 2\n");
+  if (buf->data_len <= 3)
     return -ENOMEM; // TBD: err to indicate wrong data size
-  }
   if (buf->data[0]) {
-    dev_err(&node->dev, "DARN DARN DARN msg status was %d\n", buf->data[0]);
+    pr_err("Function info msg status was %d\n", buf->data[0]);
     return -ENOMEM; // TBD: err to indicate wrong module index
   }
 
   *no_of_attrs = smartio_read_16bit(buf, 1);
   strncpy(name, buf->data+3, SMARTIO_NAME_SIZE);
   name[SMARTIO_NAME_SIZE] = '\0';
-  
   return 0;
 }
 
@@ -402,65 +991,586 @@ struct attr_info {
   char name[SMARTIO_NAME_SIZE+1];
 };
 
-int smartio_get_attr_info(struct smartio_node* node, 
-	       	          int module,
-			  int attr,
-			  struct attr_info *info)
+/* Decode one attribute definition: flags, array size, type, name
+   and ending NUL. Returns the number of bytes used. */
+static int smartio_decode_attr_info(const uint8_t *def,
+				    int len,
+				    struct attr_info *info)
 {
-  struct smartio_comm_buf* buf;
-  int status;
+  int name_len;
 
-  buf = kzalloc(sizeof *buf, GFP_KERNEL);
-  if (!buf) 
-    return -ENOMEM;
+  if (len < 4)
+    return -EINVAL;
+  name_len = strnlen((const char *) def + 3, len - 3);
+  if (name_len == len - 3)
+    return -EINVAL; /* No ending NUL */
+
+  info->input = (def[0] & IO_IS_INPUT) ? 1 : 0;
+  info->output = (def[0] & IO_IS_OUTPUT) ? 1 : 0;
+  info->device = (def[0] & IO_IS_DEVICE) ? 1 : 0;
+  info->isDir = (def[0] & IO_IS_DIR) ? 1 : 0;
+  info->arr_size = def[1];
+  info->type = def[2];
+  memcpy(info->name, def + 3, min(name_len, SMARTIO_NAME_SIZE));
+  info->name[min(name_len, SMARTIO_NAME_SIZE)] = '\0';
+  return 3 + name_len + 1;
+}
 
-  buf->data_len = 4; // module + command + attr ix
-  buf->data[0] = module;
-  buf->data[1] = SMARTIO_GET_ATTRIBUTE_DEFINITION;
-  smartio_write_16bit(buf, 2, attr);
-  status = post_request(node, buf);
-  if (status < 0) {
-    dev_err(&node->dev, "DARN DARN DARN\n");
-    return status;
-  }
+/* Decode the response to SMARTIO_GET_ATTRIBUTE_DEFINITION */
+static int smartio_parse_attr_info(struct smartio_comm_buf *buf,
+				   struct attr_info *info)
+{
+  int used;
 
-  if (buf->data_len <= 3) {
-    dev_err(&node->dev, "DARN DARN DARN 2\n");
+  if (buf->data_len <= 3)
     return -ENOMEM; // TBD: err to indicate wrong data size
-  }
   if (buf->data[0]) {
-    dev_err(&node->dev, "DARN DARN DARN msg status was %d\n", buf->data[0]);
+    pr_err("Attribute definition msg status was %d\n", buf->data[0]);
     return -ENOMEM; // TBD: err to indicate wrong module index
   }
 
-  info->input = (buf->data[1] & IO_IS_INPUT) ? 1 : 0;
-  info->output = (buf->data[1] & IO_IS_OUTPUT) ? 1 : 0;
-  info->device = (buf->data[1] & IO_IS_DEVICE) ? 1 : 0;
-  info->isDir = (buf->data[1] & IO_IS_DIR) ? 1 : 0;
-  info->arr_size = buf->data[2];
-  info->type = buf->data[3];
-  strncpy(info->name, buf->data+4, SMARTIO_NAME_SIZE);
-  info->name[SMARTIO_NAME_SIZE] = '\0';
-  #if 0
-  dev_warn(&node->dev, "Read attribute def\n");
-  dev_warn(&node->dev, "buf len: %d\n", buf->data_len);
-  dev_warn(&node->dev, "flags: %d\n", buf->data[1]);
-  dev_warn(&node->dev, "arr_size: %d\n", buf->data[2]);
-  dev_warn(&node->dev, "type: %d\n", buf->data[3]);
-  dev_warn(&node->dev, "name: %s\n", info->name);
-#endif
-  return 0;
+  used = smartio_decode_attr_info(buf->data + 1, buf->data_len - 1, info);
+  return (used < 0) ? used : 0;
 }
 
-
-static int smartio_get_attr_value(struct fcn_dev *fcn_dev,
-				  int attr,
-				  int arr_ix,
-				  void *data,
-				  int *len)
-{
+/* Introspection of a node. Rather than one round trip at a time,
+   the questions of a stage are queued ahead, up to
+   INTROSPECT_MAX_PENDING at a time, so the window of the node is
+   kept full. Answers are filled in as they arrive.
+   Callbacks are serialized by the io lock of the node. */
+struct smartio_module_desc {
   int status;
-  struct smartio_comm_buf* buf = kzalloc(sizeof *buf, GFP_KERNEL);
+  int no_of_attrs;
+  char name[SMARTIO_NAME_SIZE+1];
+  struct attr_info *info;
+  /* Attribute table read with GET_STRING */
+  int table_status;
+  uint8_t *table;
+  int table_len;
+  int table_chunk;
+  int table_received;
+};
+
+/* Questions queued at most at a time; a node may claim thousands of
+   attributes */
+#define INTROSPECT_MAX_PENDING 32
+
+struct smartio_introspection {
+  struct smartio_node *node;
+  int no_of_modules;
+  struct smartio_module_desc *modules; /* Indexed by module number */
+  atomic_t pending;
+  struct completion done;
+  struct semaphore room; /* Counts down from INTROSPECT_MAX_PENDING */
+};
+
+/* Store one chunk of an attribute table. The first chunk tells the
+   size of the table, and of the chunks the node sends. */
+static int smartio_store_table_chunk(struct smartio_module_desc *mod,
+				     struct smartio_comm_buf *req,
+				     struct smartio_comm_buf *resp)
+{
+  int ofs = smartio_read_16bit(req, 4);
+  int len = resp->data_len - SMARTIO_STRING_HDR_SIZE;
+
+  if ((len < 0) || resp->data[0])
+    return -EIO;
+  if (ofs == 0) {
+    if (mod->table)
+      return -EINVAL; /* The first chunk again */
+    mod->table_len = smartio_read_16bit(resp, 1);
+    if ((len == 0) || (mod->table_len == 0))
+      return -EINVAL;
+    mod->table_chunk = len;
+    mod->table = kmalloc(mod->table_len, GFP_KERNEL);
+    if (!mod->table)
+      return -ENOMEM;
+  }
+  if (!mod->table || (ofs >= mod->table_len))
+    return -EINVAL;
+
+  len = min(len, mod->table_len - ofs);
+  memcpy(mod->table + ofs, resp->data + SMARTIO_STRING_HDR_SIZE, len);
+  mod->table_received += len;
+  return 0;
+}
+
+/* Fill in the attribute definitions from a complete table */
+static int smartio_parse_attr_table(struct smartio_module_desc *mod)
+{
+  const uint8_t *p = mod->table;
+  int left = mod->table_len;
+  int i;
+
+  if (mod->table_received != mod->table_len)
+    return -EIO;
+
+  for (i=0; i < mod->no_of_attrs; i++) {
+    int used = smartio_decode_attr_info(p, left, &mod->info[i]);
+
+    if (used < 0)
+      return used;
+    p += used;
+    left -= used;
+  }
+  return 0;
+}
+
+static void introspection_cb(struct smartio_comm_buf *req,
+			     struct smartio_comm_buf *resp,
+			     void *data)
+{
+  struct smartio_introspection *intro = data;
+  struct smartio_module_desc *mod = &intro->modules[req->data[0]];
+  int status;
+
+  if (!resp)
+    status = req->status ? req->status : -EIO;
+  else if (req->data[1] == SMARTIO_GET_NO_OF_ATTRIBUTES)
+    status = smartio_parse_function_info(resp, &mod->no_of_attrs, mod->name);
+  else if (req->data[1] == SMARTIO_GET_STRING)
+    status = smartio_store_table_chunk(mod, req, resp);
+  else
+    status = smartio_parse_attr_info(resp,
+				     &mod->info[smartio_read_16bit(req, 2)]);
+
+  /* A table which cannot be read is queried attribute by attribute */
+  if (status && (req->data[1] == SMARTIO_GET_STRING)) {
+    mod->table_status = status;
+    /* The first chunk, sent without resends, tells whether the node
+       reads tables at all */
+    if ((smartio_read_16bit(req, 4) == 0) &&
+	((status == -ETIMEDOUT) || (resp && (resp->data_len >= 1) && resp->data[0])))
+      intro->node->no_get_string = true;
+  }
+  else if (status)
+    mod->status = status;
+
+  smartio_free_comm_buf(req);
+  /* Before the count drops, after which intro may be gone */
+  up(&intro->room);
+  if (atomic_dec_and_test(&intro->pending))
+    complete(&intro->done);
+}
+
+static int introspection_submit(struct smartio_introspection *intro,
+				int module,
+				int cmd,
+				int attr,
+				int ofs,
+				int resends)
+{
+  struct smartio_comm_buf *buf;
+  int status;
+
+  buf = smartio_alloc_comm_buf(GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+
+  down(&intro->room);
+  buf->data[0] = module;
+  buf->data[1] = cmd;
+  if (cmd == SMARTIO_GET_ATTRIBUTE_DEFINITION) {
+    buf->data_len = 4; // module + command + attr ix
+    smartio_write_16bit(buf, 2, attr);
+  }
+  else if (cmd == SMARTIO_GET_STRING) {
+    buf->data_len = SMARTIO_STRING_REQ_SIZE;
+    smartio_write_16bit(buf, 2, attr);
+    smartio_write_16bit(buf, 4, ofs);
+  }
+  else
+    buf->data_len = 2; // module + command
+  buf->cb = introspection_cb;
+  buf->cb_data = intro;
+  smartio_prepare_request(intro->node, buf);
+  buf->retries = resends;
+  atomic_inc(&intro->pending);
+  status = smartio_enqueue_request(intro->node, buf);
+  if (status) {
+    atomic_dec(&intro->pending);
+    up(&intro->room);
+    smartio_free_comm_buf(buf);
+  }
+  return status;
+}
+
+/* Wait for all answers of the current stage. Every request
+   completes, at the latest when it runs out of retries. */
+static void introspection_wait(struct smartio_introspection *intro)
+{
+  if (!atomic_dec_and_test(&intro->pending))
+    wait_for_completion(&intro->done);
+  reinit_completion(&intro->done);
+  atomic_set(&intro->pending, 1);
+}
+
+/* Download the attribute table of every module. The first chunk
+   gives the size of the table; the rest are then asked for at once.
+   Nodes which do not know GET_STRING either refuse it or never
+   answer, so the first chunk is sent without resends, and a node
+   which fails it is not asked again. */
+static int smartio_introspect_tables(struct smartio_introspection *intro)
+{
+  int status = 0;
+  int i, ofs;
+
+  if (intro->node->no_get_string)
+    return 0;
+  for (i=1; (i < intro->no_of_modules) && !status; i++) {
+    struct smartio_module_desc *mod = &intro->modules[i];
+
+    if (!mod->status && mod->no_of_attrs)
+      status = introspection_submit(intro, i, SMARTIO_GET_STRING,
+				    SMARTIO_STRING_ATTR_TABLE, 0, 0);
+  }
+  introspection_wait(intro);
+  if (status)
+    return status;
+
+  for (i=1; (i < intro->no_of_modules) && !status; i++) {
+    struct smartio_module_desc *mod = &intro->modules[i];
+
+    if (mod->status || mod->table_status || !mod->table)
+      continue;
+    for (ofs = mod->table_chunk; (ofs < mod->table_len) && !status;
+	 ofs += mod->table_chunk)
+      status = introspection_submit(intro, i, SMARTIO_GET_STRING,
+				    SMARTIO_STRING_ATTR_TABLE, ofs, retries);
+  }
+  introspection_wait(intro);
+  if (status)
+    return status;
+
+  for (i=1; i < intro->no_of_modules; i++) {
+    struct smartio_module_desc *mod = &intro->modules[i];
+
+    if (mod->status || mod->table_status || !mod->table)
+      continue;
+    mod->table_status = smartio_parse_attr_table(mod);
+    if (mod->table_status)
+      dev_warn(&intro->node->dev, "Bad attribute table in module %d\n", i);
+  }
+  return 0;
+}
+
+/* Read function info of all modules, then the definitions of all
+   their attributes. These come from the attribute table of the
+   module, or failing that, from one query per attribute. */
+static int smartio_introspect(struct smartio_introspection *intro)
+{
+  int status = 0;
+  int i, a;
+
+  atomic_set(&intro->pending, 1);
+  init_completion(&intro->done);
+  sema_init(&intro->room, INTROSPECT_MAX_PENDING);
+
+  for (i=1; (i < intro->no_of_modules) && !status; i++)
+    status = introspection_submit(intro, i, SMARTIO_GET_NO_OF_ATTRIBUTES,
+				  0, 0, retries);
+  introspection_wait(intro);
+  if (status)
+    return status;
+
+  for (i=1; i < intro->no_of_modules; i++) {
+    struct smartio_module_desc *mod = &intro->modules[i];
+
+    if (mod->status)
+      continue;
+    mod->info = kcalloc(mod->no_of_attrs, sizeof *mod->info, GFP_KERNEL);
+    if (!mod->info)
+      return -ENOMEM;
+  }
+
+  if (desc_download) {
+    status = smartio_introspect_tables(intro);
+    if (status)
+      return status;
+  }
+
+  for (i=1; (i < intro->no_of_modules) && !status; i++) {
+    struct smartio_module_desc *mod = &intro->modules[i];
+
+    if (mod->status || (mod->table && !mod->table_status))
+      continue;
+    for (a=0; (a < mod->no_of_attrs) && !status; a++)
+      status = introspection_submit(intro, i,
+				    SMARTIO_GET_ATTRIBUTE_DEFINITION, a, 0,
+				    retries);
+  }
+  introspection_wait(intro);
+
+  return status;
+}
+
+/* Forget all answers, keeping the modules array */
+static void smartio_reset_introspection(struct smartio_introspection *intro)
+{
+  int i;
+
+  for (i=0; i < intro->no_of_modules; i++) {
+    kfree(intro->modules[i].info);
+    kfree(intro->modules[i].table);
+  }
+  memset(intro->modules, 0, intro->no_of_modules * sizeof *intro->modules);
+}
+
+static void smartio_free_introspection(struct smartio_introspection *intro)
+{
+  smartio_reset_introspection(intro);
+  kfree(intro->modules);
+}
+
+
+/* Descriptors of nodes already seen, keyed by the descriptor hash
+   the nodes report. They are kept while the module is loaded, so a
+   node which is reset, and identical nodes, are introspected once.
+   A descriptor may also be installed as firmware file
+   smartio/desc-<hash>.bin.
+   Format: version, no of modules (16 bit), then for each module but
+   module 0: no of attributes (16 bit), name and ending NUL, followed
+   by its attribute records as in the GET_STRING attribute table. */
+#define SMARTIO_DESC_VERSION 1
+
+struct smartio_desc_blob {
+  struct hlist_node node;
+  u32 hash;
+  size_t len;
+  uint8_t data[];
+};
+
+static DEFINE_HASHTABLE(desc_blobs, 4);
+static DEFINE_MUTEX(desc_blobs_lock);
+
+/* Nodes which do not know GET_DESC_HASH either refuse it or never
+   answer. It is asked once, without resends, and a node which fails
+   it is not asked again. */
+static int smartio_get_desc_hash(struct smartio_node *node, u32 *hash)
+{
+  struct smartio_comm_buf* buf;
+  int status;
+
+  if (node->no_desc_hash)
+    return -EOPNOTSUPP;
+  buf = smartio_alloc_comm_buf(GFP_KERNEL);
+  if (!buf) 
+    return -ENOMEM;
+
+  buf->data_len = 2; // module + command
+  buf->data[0] = 0;
+  buf->data[1] = SMARTIO_GET_DESC_HASH;
+  status = post_request_resends(node, buf, 0);
+  if (status == -ETIMEDOUT)
+    node->no_desc_hash = true;
+  if (status < 0)
+    goto free_buf;
+
+  if ((buf->data_len < SMARTIO_DESC_HASH_RESP_SIZE) || buf->data[0]) {
+    node->no_desc_hash = true;
+    status = -EIO;
+    goto free_buf;
+  }
+  *hash = ((u32) smartio_read_16bit(buf, 1) << 16) |
+    smartio_read_16bit(buf, 3);
+  status = *hash ? 0 : -ENOENT;
+
+ free_buf:
+  smartio_free_comm_buf(buf);
+  return status;
+}
+
+/* Inverse of smartio_decode_attr_info(). With p NULL, only the
+   size is returned. */
+static int smartio_encode_attr_info(const struct attr_info *info,
+				    uint8_t *p)
+{
+  int name_len = strlen(info->name);
+
+  if (p) {
+    p[0] = (info->input ? IO_IS_INPUT : 0) |
+      (info->output ? IO_IS_OUTPUT : 0) |
+      (info->device ? IO_IS_DEVICE : 0) |
+      (info->isDir ? IO_IS_DIR : 0);
+    p[1] = info->arr_size;
+    p[2] = info->type;
+    memcpy(p + 3, info->name, name_len + 1);
+  }
+  return 3 + name_len + 1;
+}
+
+static size_t smartio_encode_desc(const struct smartio_introspection *intro,
+				  uint8_t *p)
+{
+  size_t len = 3;
+  int i, a;
+
+  if (p) {
+    p[0] = SMARTIO_DESC_VERSION;
+    p[1] = intro->no_of_modules >> 8;
+    p[2] = intro->no_of_modules;
+  }
+  for (i=1; i < intro->no_of_modules; i++) {
+    const struct smartio_module_desc *mod = &intro->modules[i];
+    int name_len = strlen(mod->name);
+
+    if (p) {
+      p[len] = mod->no_of_attrs >> 8;
+      p[len+1] = mod->no_of_attrs;
+      memcpy(p + len + 2, mod->name, name_len + 1);
+    }
+    len += 2 + name_len + 1;
+    for (a=0; a < mod->no_of_attrs; a++)
+      len += smartio_encode_attr_info(&mod->info[a], p ? p + len : NULL);
+  }
+  return len;
+}
+
+static int smartio_decode_desc(struct smartio_introspection *intro,
+			       const uint8_t *p,
+			       size_t len)
+{
+  size_t pos = 3;
+  int i, a;
+
+  if ((len < pos) || (p[0] != SMARTIO_DESC_VERSION) ||
+      (((p[1] << 8) | p[2]) != intro->no_of_modules))
+    return -EINVAL;
+
+  for (i=1; i < intro->no_of_modules; i++) {
+    struct smartio_module_desc *mod = &intro->modules[i];
+    int name_len;
+
+    if (len - pos < 3)
+      return -EINVAL;
+    mod->no_of_attrs = (p[pos] << 8) | p[pos+1];
+    pos += 2;
+    name_len = strnlen((const char *) p + pos, len - pos);
+    if (name_len == len - pos)
+      return -EINVAL; /* No ending NUL */
+    memcpy(mod->name, p + pos, min(name_len, SMARTIO_NAME_SIZE));
+    mod->name[min(name_len, SMARTIO_NAME_SIZE)] = '\0';
+    pos += name_len + 1;
+
+    mod->info = kcalloc(mod->no_of_attrs, sizeof *mod->info, GFP_KERNEL);
+    if (!mod->info)
+      return -ENOMEM;
+    for (a=0; a < mod->no_of_attrs; a++) {
+      int used = smartio_decode_attr_info(p + pos, len - pos, &mod->info[a]);
+
+      if (used < 0)
+	return used;
+      pos += used;
+    }
+  }
+  return (pos == len) ? 0 : -EINVAL;
+}
+
+/* Takes over blob, unless a descriptor with the same hash is known */
+static void smartio_add_desc_blob(struct smartio_desc_blob *blob)
+{
+  struct smartio_desc_blob *cur;
+
+  mutex_lock(&desc_blobs_lock);
+  hash_for_each_possible(desc_blobs, cur, node, blob->hash)
+    if (cur->hash == blob->hash)
+      goto unlock;
+  hash_add(desc_blobs, &blob->node, blob->hash);
+  blob = NULL;
+ unlock:
+  mutex_unlock(&desc_blobs_lock);
+  kfree(blob);
+}
+
+/* Remember the descriptor of a fully introspected node */
+static void smartio_save_desc(const struct smartio_introspection *intro,
+			      u32 hash)
+{
+  struct smartio_desc_blob *blob;
+  size_t len;
+  int i;
+
+  for (i=1; i < intro->no_of_modules; i++)
+    if (intro->modules[i].status)
+      return;
+
+  len = smartio_encode_desc(intro, NULL);
+  blob = kmalloc(sizeof *blob + len, GFP_KERNEL);
+  if (!blob)
+    return;
+  blob->hash = hash;
+  blob->len = len;
+  smartio_encode_desc(intro, blob->data);
+  smartio_add_desc_blob(blob);
+}
+
+/* Fill in intro from a known descriptor, from memory or from a
+   firmware file. On failure intro is left empty. */
+static int smartio_load_desc(struct smartio_introspection *intro, u32 hash)
+{
+  struct smartio_desc_blob *blob;
+  const struct firmware *fw;
+  char fw_name[32];
+  int status = -ENOENT;
+
+  mutex_lock(&desc_blobs_lock);
+  hash_for_each_possible(desc_blobs, blob, node, hash)
+    if (blob->hash == hash) {
+      status = smartio_decode_desc(intro, blob->data, blob->len);
+      break;
+    }
+  mutex_unlock(&desc_blobs_lock);
+  if (status != -ENOENT)
+    goto done;
+
+  snprintf(fw_name, sizeof fw_name, "smartio/desc-%08x.bin", hash);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0)
+  if (request_firmware_direct(&fw, fw_name, &intro->node->dev))
+#else
+  if (request_firmware(&fw, fw_name, &intro->node->dev))
+#endif
+    return -ENOENT;
+  status = smartio_decode_desc(intro, fw->data, fw->size);
+  if (!status) {
+    blob = kmalloc(sizeof *blob + fw->size, GFP_KERNEL);
+    if (blob) {
+      blob->hash = hash;
+      blob->len = fw->size;
+      memcpy(blob->data, fw->data, fw->size);
+      smartio_add_desc_blob(blob);
+    }
+  }
+  else
+    dev_warn(&intro->node->dev, "Bad descriptor file %s\n", fw_name);
+  release_firmware(fw);
+
+ done:
+  if (status)
+    smartio_reset_introspection(intro);
+  return status;
+}
+
+static void smartio_free_desc_blobs(void)
+{
+  struct smartio_desc_blob *blob;
+  struct hlist_node *tmp;
+  int bkt;
+
+  hash_for_each_safe(desc_blobs, bkt, tmp, blob, node) {
+    hash_del(&blob->node);
+    kfree(blob);
+  }
+}
+
+
+static int smartio_fetch_attr_value(struct fcn_dev *fcn_dev,
+				    int attr,
+				    int arr_ix,
+				    void *data,
+				    int *len)
+{
+  int status;
+  struct smartio_comm_buf* buf = smartio_alloc_comm_buf(GFP_KERNEL);
 
   if (!buf) 
     return -ENOMEM;
@@ -473,12 +1583,13 @@ static int smartio_get_attr_value(struct fcn_dev *fcn_dev,
   status = post_request(to_node(fcn_dev->dev.parent), buf);
   if (status < 0) {
     dev_err(&fcn_dev->dev, "DARN DARN DARN\n");
-    return status;
+    goto free_buf;
   }
 
   if (buf->data_len <= 2) {
     dev_err(&fcn_dev->dev, "get_attr_value: illegal data length %d\n", buf->data_len);
-    return -ENOMEM; // TBD: err to indicate wrong data size
+    status = -ENOMEM; // TBD: err to indicate wrong data size
+    goto free_buf;
   }
   if (buf->data[0] != SMARTIO_SUCCESS) {
     switch (buf->data[0]) {
@@ -495,27 +1606,190 @@ static int smartio_get_attr_value(struct fcn_dev *fcn_dev,
       dev_err(&fcn_dev->dev, "get_attr_value: unknown msg status %d\n", buf->data[0]);
       break;
     }
-    return -ENOMEM; // TBD: err to indicate wrong module index
+    status = -ENOMEM; // TBD: err to indicate wrong module index
+    goto free_buf;
   }
 
   memcpy(data, buf->data + 1, buf->data_len - 1);
   *len = buf->data_len - 1;
-  return 0;
+  status = 0;
+
+ free_buf:
+  smartio_free_comm_buf(buf);
+  return status;
+}
+
+/* A GET in flight which readers of the same value can share */
+struct smartio_pending_get {
+  struct hlist_node hnode;
+  u32 key;
+  struct kref ref;
+  struct completion done;
+  int status;
+  int len;
+  u8 data[SMARTIO_DATA_SIZE];
+};
+
+static struct kmem_cache *pending_get_cache;
+
+static void free_pending_get(struct kref *ref)
+{
+  kmem_cache_free(pending_get_cache,
+		  container_of(ref, struct smartio_pending_get, ref));
+}
+
+#define PENDING_GET_KEY(module, attr, arr_ix) \
+  (((u32) (module) << 24) | (((u32) (attr) & 0xFFFF) << 8) | ((arr_ix) & 0xFF))
+
+/* Read an attribute value. Readers arriving while an identical GET
+   is outstanding wait for that one and share its response, instead
+   of sending their own. If the reader which sent it is interrupted,
+   the waiters look again, and one of them sends a new GET. */
+static int smartio_get_attr_value(struct fcn_dev *fcn_dev,
+				  int attr,
+				  int arr_ix,
+				  void *data,
+				  int *len)
+{
+  struct smartio_node *node = to_node(fcn_dev->dev.parent);
+  const u32 key = PENDING_GET_KEY(fcn_dev->function_ix, attr, arr_ix);
+  struct smartio_pending_get *get;
+  int status;
+
+ retry:
+  mutex_lock(&node->gets_lock);
+  hash_for_each_possible(node->gets, get, hnode, key) {
+    if (get->key == key) {
+      kref_get(&get->ref);
+      mutex_unlock(&node->gets_lock);
+      goto wait;
+    }
+  }
+  get = kmem_cache_alloc(pending_get_cache, GFP_KERNEL);
+  if (!get) {
+    mutex_unlock(&node->gets_lock);
+    return -ENOMEM;
+  }
+  get->key = key;
+  kref_init(&get->ref);
+  init_completion(&get->done);
+  hash_add(node->gets, &get->hnode, key);
+  mutex_unlock(&node->gets_lock);
+
+  get->status = smartio_fetch_attr_value(fcn_dev, attr, arr_ix,
+					 get->data, &get->len);
+  mutex_lock(&node->gets_lock);
+  /* Unless a write took it out already */
+  hash_del(&get->hnode);
+  mutex_unlock(&node->gets_lock);
+  complete_all(&get->done);
+  status = get->status;
+  goto copy;
+
+ wait:
+  if (wait_for_completion_interruptible(&get->done)) {
+    status = -ERESTARTSYS;
+    goto put;
+  }
+  status = get->status;
+  /* The signal went to the reader that sent the request, not to us */
+  if (status == -ERESTARTSYS) {
+    kref_put(&get->ref, free_pending_get);
+    goto retry;
+  }
+
+ copy:
+  if (!status) {
+    memcpy(data, get->data, get->len);
+    *len = get->len;
+  }
+ put:
+  kref_put(&get->ref, free_pending_get);
+  return status;
+}
+
+/* A GET in flight when a write starts may have been answered before
+   the write. Readers arriving from now on must not share it, so it is
+   taken out of the table; those already waiting still get it. */
+static void smartio_forget_get(struct smartio_node *node, u32 key)
+{
+  struct smartio_pending_get *get;
+
+  mutex_lock(&node->gets_lock);
+  hash_for_each_possible(node->gets, get, hnode, key) {
+    if (get->key == key) {
+      hash_del(&get->hnode);
+      break;
+    }
+  }
+  mutex_unlock(&node->gets_lock);
+}
+
+/* Result of a write other writers were merged into */
+struct smartio_merged_write {
+  struct kref ref;
+  struct completion done;
+  int status;
+};
+
+static void free_merged_write(struct kref *ref)
+{
+  kfree(container_of(ref, struct smartio_merged_write, ref));
 }
 
+/* With combine_slot set, a write which is still queued for the same
+   attribute is updated with the new value instead of queueing another
+   one. The caller whose value was merged waits for that write, and
+   gets its result. A write carrying merged values is sent even if the
+   caller which queued it is interrupted. */
 int smartio_set_attr_value(struct fcn_dev* fcn_dev, 
 			   int attr,
 			   int arr_ix,
 			   void *data,
-			   int len)
+			   int len,
+			   struct smartio_comm_buf **combine_slot)
 {
+  struct smartio_node *node = to_node(fcn_dev->dev.parent);
   struct smartio_comm_buf* buf;
   int status;
 
-  buf = kzalloc(sizeof *buf, GFP_KERNEL);
+  smartio_forget_get(node, PENDING_GET_KEY(fcn_dev->function_ix, attr, arr_ix));
+  if (combine_slot) {
+    struct smartio_merged_write *merged = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&node->tx_lock, flags);
+    buf = *combine_slot;
+    if (buf && !buf->merged) {
+      buf->merged = kmalloc(sizeof *buf->merged, GFP_ATOMIC);
+      if (buf->merged) {
+	kref_init(&buf->merged->ref); /* Held by the write */
+	init_completion(&buf->merged->done);
+      }
+    }
+    if (buf && buf->merged) {
+      buf->data_len = 5 + len;
+      memcpy(buf->data + 5, data, len);
+      merged = buf->merged;
+      kref_get(&merged->ref);
+    }
+    spin_unlock_irqrestore(&node->tx_lock, flags);
+    if (merged) {
+      dev_info(&fcn_dev->dev, "Combined %d bytes of attr data with queued write\n", len);
+      /* It completes, at the latest when out of retries */
+      wait_for_completion(&merged->done);
+      status = merged->status;
+      kref_put(&merged->ref, free_merged_write);
+      return status;
+    }
+  }
+
+  buf = smartio_alloc_comm_buf(GFP_KERNEL);
   if (!buf) 
     return -ENOMEM;
 
+  buf->prio = SMARTIO_PRIO_CONTROL; /* Outputs go before bulk reads */
+  buf->pending_ref = combine_slot;
   buf->data_len = 5 + len; // module + command + attr ix + array ix
   buf->data[0] = fcn_dev->function_ix;
   buf->data[1] =  SMARTIO_SET_ATTR_VALUE;
@@ -523,15 +1797,16 @@ int smartio_set_attr_value(struct fcn_dev* fcn_dev,
   buf->data[4] = arr_ix;
   memcpy(buf->data + 5, data, len);
   dev_info(&fcn_dev->dev, "Posting %d bytes of attr data\n", len);
-  status = post_request(to_node(fcn_dev->dev.parent), buf);
+  status = post_request(node, buf);
   if (status < 0) {
     dev_err(&fcn_dev->dev, "%s: request failed. Error %d\n", __func__, status);
-    return status;
+    goto free_buf;
   }
 
   if (buf->data_len != 1) {
     dev_err(&fcn_dev->dev, "%s: illegal data length %d\n", __func__, buf->data_len);
-    return -ENOMEM; // TBD: err to indicate wrong data size
+    status = -ENOMEM; // TBD: err to indicate wrong data size
+    goto free_buf;
   }
   if (buf->data[0] != SMARTIO_SUCCESS) {
     switch (buf->data[0]) {
@@ -550,12 +1825,397 @@ int smartio_set_attr_value(struct fcn_dev* fcn_dev,
     default:
       dev_err(&fcn_dev->dev, "%s: unknown msg status %d\n", __func__, buf->data[0]);
     }
-    return -ENOMEM; // TBD: err to indicate wrong module index
+    status = -ENOMEM; // TBD: err to indicate wrong module index
+    goto free_buf;
   }
 
+  status = 0;
+
+ free_buf:
+  if (buf->merged) {
+    buf->merged->status = status;
+    complete_all(&buf->merged->done);
+    kref_put(&buf->merged->ref, free_merged_write);
+  }
+  smartio_free_comm_buf(buf);
+  return status;
+}
+
+
+/* Pack as many gets as fit in one frame. Returns the number packed. */
+static int fillbuf_get_multi(struct smartio_comm_buf *buf,
+			     const struct smartio_attr_value *values,
+			     int n)
+{
+  const int max = (SMARTIO_DATA_SIZE - SMARTIO_MULTI_HDR_SIZE) /
+    SMARTIO_MULTI_TUPLE_SIZE;
+  uint8_t *p = buf->data + SMARTIO_MULTI_HDR_SIZE;
+  int i;
+
+  n = min(n, max);
+  buf->data[0] = 0;
+  buf->data[1] = SMARTIO_GET_MULTI;
+  buf->data[2] = n;
+  for (i=0; i < n; i++) {
+    *p++ = values[i].module;
+    *p++ = values[i].attr >> 8;
+    *p++ = values[i].attr;
+    *p++ = values[i].array;
+  }
+  buf->data_len = p - buf->data;
+  return n;
+}
+
+
+/* Pack as many sets as fit in one frame. Returns the number packed. */
+static int fillbuf_set_multi(struct smartio_comm_buf *buf,
+			     const struct smartio_attr_value *values,
+			     int n)
+{
+  uint8_t *p = buf->data + SMARTIO_MULTI_HDR_SIZE;
+  const uint8_t * const end = buf->data + SMARTIO_DATA_SIZE;
+  int i;
+
+  buf->data[0] = 0;
+  buf->data[1] = SMARTIO_SET_MULTI;
+  for (i=0; i < n; i++) {
+    if (p + SMARTIO_MULTI_TUPLE_SIZE + 1 + values[i].len > end)
+      break;
+    *p++ = values[i].module;
+    *p++ = values[i].attr >> 8;
+    *p++ = values[i].attr;
+    *p++ = values[i].array;
+    *p++ = values[i].len;
+    memcpy(p, values[i].data, values[i].len);
+    p += values[i].len;
+  }
+  buf->data[2] = i;
+  buf->data_len = p - buf->data;
+  return i;
+}
+
+
+/* Nodes with older firmware do not know the MULTI commands, and
+   either refuse them or never answer. Such a node is remembered, and
+   its batches are sent one value per request. */
+static bool smartio_multi_refused(struct smartio_node *node,
+				  struct smartio_comm_buf *buf,
+				  int status)
+{
+  if ((status == -ETIMEDOUT) ||
+      ((status == 0) && (buf->data_len >= 1) &&
+       (buf->data[0] != SMARTIO_SUCCESS))) {
+    dev_info(&node->dev, "Node does not handle batches, sending single values\n");
+    node->no_multi = true;
+  }
+  return node->no_multi;
+}
+
+static int smartio_get_single_values(struct smartio_node *node,
+				     struct smartio_comm_buf *buf,
+				     struct smartio_attr_value *values,
+				     int n)
+{
+  int status;
+  int i;
+
+  for (i=0; i < n; i++) {
+    struct smartio_attr_value *v = &values[i];
+
+    buf->data_len = 5; // module + command + attr ix + array ix
+    buf->data[0] = v->module;
+    buf->data[1] = SMARTIO_GET_ATTR_VALUE;
+    smartio_write_16bit(buf, 2, v->attr);
+    buf->data[4] = v->array;
+    status = post_request(node, buf);
+    if (status < 0)
+      return status;
+    if ((buf->data_len < 1) || (buf->data_len - 1 > sizeof v->data)) {
+      dev_err(&node->dev, "%s: illegal data length %d\n",
+	      __func__, buf->data_len);
+      return -EIO;
+    }
+    v->status = buf->data[0];
+    v->len = 0;
+    if (v->status == SMARTIO_SUCCESS) {
+      v->len = buf->data_len - 1;
+      memcpy(v->data, buf->data + 1, v->len);
+    }
+  }
   return 0;
 }
 
+static int smartio_set_single_values(struct smartio_node *node,
+				     struct smartio_comm_buf *buf,
+				     struct smartio_attr_value *values,
+				     int n)
+{
+  int status;
+  int i;
+
+  for (i=0; i < n; i++) {
+    struct smartio_attr_value *v = &values[i];
+
+    if (v->len > sizeof v->data)
+      return -EINVAL;
+    buf->data_len = 5 + v->len; // module + command + attr ix + array ix
+    buf->data[0] = v->module;
+    buf->data[1] = SMARTIO_SET_ATTR_VALUE;
+    smartio_write_16bit(buf, 2, v->attr);
+    buf->data[4] = v->array;
+    memcpy(buf->data + 5, v->data, v->len);
+    status = post_request(node, buf);
+    if (status < 0)
+      return status;
+    if (buf->data_len != 1) {
+      dev_err(&node->dev, "%s: illegal data length %d\n",
+	      __func__, buf->data_len);
+      return -EIO;
+    }
+    v->status = buf->data[0];
+  }
+  return 0;
+}
+
+/* Read a batch of attribute values with as few transactions as
+   possible. The batch is split over as many frames as needed.
+   Returns 0 when every value got an answer; check the status of
+   each value for errors reported by the node. */
+int smartio_get_attr_values(struct smartio_node *node,
+			    struct smartio_attr_value *values,
+			    int n)
+{
+  struct smartio_comm_buf *buf;
+  int done = 0;
+  int status = 0;
+
+  buf = smartio_alloc_comm_buf(GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+
+  while ((done < n) && !node->no_multi) {
+    const uint8_t *p;
+    const uint8_t *end;
+    int packed;
+    int answered;
+    int i;
+
+    packed = fillbuf_get_multi(buf, values + done, n - done);
+    status = post_request(node, buf);
+    if (!done && smartio_multi_refused(node, buf, status))
+      break;
+    if (status < 0)
+      break;
+    if ((buf->data_len < 2) || (buf->data[0] != SMARTIO_SUCCESS) ||
+	(buf->data[1] == 0)) {
+      dev_err(&node->dev, "%s: node refused batch, status %d\n",
+	      __func__, buf->data[0]);
+      status = -EIO;
+      break;
+    }
+
+    answered = min((int) buf->data[1], packed);
+    p = buf->data + 2;
+    end = buf->data + buf->data_len;
+    for (i=0; i < answered; i++) {
+      struct smartio_attr_value *v = &values[done + i];
+
+      if ((p + 2 > end) || (p + 2 + p[1] > end) || (p[1] > sizeof v->data)) {
+	dev_err(&node->dev, "%s: malformed response\n", __func__);
+	status = -EIO;
+	goto free_buf;
+      }
+      v->status = p[0];
+      v->len = p[1];
+      memcpy(v->data, p + 2, v->len);
+      p += 2 + v->len;
+    }
+    done += answered;
+  }
+  if (node->no_multi)
+    status = smartio_get_single_values(node, buf, values + done, n - done);
+
+ free_buf:
+  smartio_free_comm_buf(buf);
+  return status < 0 ? status : 0;
+}
+EXPORT_SYMBOL_GPL(smartio_get_attr_values);
+
+
+/* Write a batch of attribute values with as few transactions as
+   possible. Returns 0 when the node handled every value; check the
+   status of each value for errors reported by the node. */
+int smartio_set_attr_values(struct smartio_node *node,
+			    struct smartio_attr_value *values,
+			    int n)
+{
+  struct smartio_comm_buf *buf;
+  int done = 0;
+  int status = 0;
+  int i;
+
+  buf = smartio_alloc_comm_buf(GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+
+  for (i=0; i < n; i++)
+    smartio_forget_get(node, PENDING_GET_KEY(values[i].module,
+					     values[i].attr, values[i].array));
+  buf->prio = SMARTIO_PRIO_CONTROL;
+  while ((done < n) && !node->no_multi) {
+    int sent;
+    int handled;
+
+    sent = fillbuf_set_multi(buf, values + done, n - done);
+    if (!sent) {
+      dev_err(&node->dev, "%s: value %d too large for a frame\n",
+	      __func__, done);
+      status = -EINVAL;
+      break;
+    }
+    status = post_request(node, buf);
+    if (!done && smartio_multi_refused(node, buf, status))
+      break;
+    if (status < 0)
+      break;
+    if ((buf->data_len < 2) || (buf->data[0] != SMARTIO_SUCCESS) ||
+	(buf->data[1] == 0)) {
+      dev_err(&node->dev, "%s: node refused batch, status %d\n",
+	      __func__, buf->data[0]);
+      status = -EIO;
+      break;
+    }
+
+    handled = min3((int) buf->data[1], sent, buf->data_len - 2);
+    if (!handled) {
+      dev_err(&node->dev, "%s: no status in response\n", __func__);
+      status = -EIO;
+      break;
+    }
+    for (i=0; i < handled; i++)
+      values[done + i].status = buf->data[2 + i];
+    done += handled;
+  }
+  if (node->no_multi)
+    status = smartio_set_single_values(node, buf, values + done, n - done);
+
+  smartio_free_comm_buf(buf);
+  return status < 0 ? status : 0;
+}
+EXPORT_SYMBOL_GPL(smartio_set_attr_values);
+
+/* Room left in a sysfs buffer for one more array element */
+#define ARRAY_ELEM_MAX 64
+
+/* Array attributes are read and written whole, one element per line,
+   with a batch of values rather than one request per element where
+   the node handles batches. */
+static ssize_t show_fcn_array(struct fcn_dev *fcn,
+			      const struct fcn_attribute *fcn_attr,
+			      char *buf)
+{
+	const int n = fcn_attr->arr_size;
+	struct smartio_attr_value *values;
+	ssize_t len = 0;
+	int status;
+	int i;
+
+	values = kcalloc(n, sizeof *values, GFP_KERNEL);
+	if (!values)
+		return -ENOMEM;
+	for (i=0; i < n; i++) {
+		values[i].module = fcn->function_ix;
+		values[i].attr = fcn_attr->attr_ix;
+		values[i].array = i;
+	}
+	status = smartio_get_attr_values(to_node(fcn->dev.parent), values, n);
+	if (status < 0)
+		goto free_values;
+
+	for (i=0; (i < n) && (PAGE_SIZE - len > ARRAY_ELEM_MAX); i++) {
+		u8 raw[ATTR_MAX_PAYLOAD+1] = { 0 };
+
+		if (values[i].status != SMARTIO_SUCCESS) {
+			dev_err(&fcn->dev, "%s: element %d, msg status %d\n",
+				__func__, i, values[i].status);
+			status = -EIO;
+			goto free_values;
+		}
+		memcpy(raw, values[i].data, values[i].len);
+		smartio_raw_to_string(fcn_attr->type, raw, buf + len);
+		len += strlen(buf + len);
+	}
+	status = len;
+
+ free_values:
+	kfree(values);
+	return status;
+}
+
+/* Elements are separated by commas or newlines. Fewer elements than
+   the array holds write the first ones. */
+static ssize_t store_fcn_array(struct fcn_dev *fcn,
+			       const struct fcn_attribute *fcn_attr,
+			       const char *buf,
+			       size_t count)
+{
+	const int n = fcn_attr->arr_size;
+	struct smartio_attr_value *values;
+	char *copy, *p, *tok;
+	int status = 0;
+	int k = 0;
+	int i;
+
+	copy = kstrndup(buf, count, GFP_KERNEL);
+	values = kcalloc(n, sizeof *values, GFP_KERNEL);
+	if (!copy || !values) {
+		status = -ENOMEM;
+		goto free_values;
+	}
+
+	p = copy;
+	while ((tok = strsep(&p, ",\n")) != NULL) {
+		char rawbuf[40];
+		int raw_len;
+
+		tok = strim(tok);
+		if (!*tok)
+			continue;
+		if ((k == n) || (strlen(tok) > ATTR_MAX_PAYLOAD)) {
+			status = -EINVAL;
+			goto free_values;
+		}
+		smartio_string_to_raw(fcn_attr->type, tok, rawbuf, &raw_len);
+		if ((raw_len < 0) || (raw_len > ATTR_MAX_PAYLOAD)) {
+			status = -EINVAL;
+			goto free_values;
+		}
+		values[k].module = fcn->function_ix;
+		values[k].attr = fcn_attr->attr_ix;
+		values[k].array = k;
+		values[k].len = raw_len;
+		memcpy(values[k].data, rawbuf, raw_len);
+		k++;
+	}
+	if (!k) {
+		status = -EINVAL;
+		goto free_values;
+	}
+
+	status = smartio_set_attr_values(to_node(fcn->dev.parent), values, k);
+	for (i=0; (i < k) && !status; i++)
+		if (values[i].status != SMARTIO_SUCCESS) {
+			dev_err(&fcn->dev, "%s: element %d, msg status %d\n",
+				__func__, i, values[i].status);
+			status = -EIO;
+		}
+
+ free_values:
+	kfree(values);
+	kfree(copy);
+	return status ? status : count;
+}
+
 #if 0
 static void dump_node(struct device * dev)
 {
@@ -575,16 +2235,45 @@ static ssize_t show_fcn_attr(struct device *dev,
 	int bytes_read;
 	struct fcn_dev *fcn = container_of(dev, struct fcn_dev, dev);
 	struct fcn_attribute* fcn_attr = container_of(attr, struct fcn_attribute, dev_attr);
+	struct fcn_attr_state *st = &fcn->attr_state[fcn_attr->attr_ix];
+	const unsigned int max_age = (st->max_age_ms < 0) ?
+		fcn->cache_max_age_ms : st->max_age_ms;
+	unsigned int gen;
+	bool hit = false;
 
 	dev_info(dev, "Calling show fcn for node %d, fcn ix %d, attr %s, ix %d, type %d\n", 
 		 dev->parent->id, fcn->function_ix, attr->attr.name, 
                  fcn_attr->attr_ix, fcn_attr->type);
-
-	result = smartio_get_attr_value(fcn,
-					fcn_attr->attr_ix,
-					0xFF, /* No arrays for now */
-					mybuf,
-					&bytes_read);
+	if (fcn_attr->arr_size > 1)
+		return show_fcn_array(fcn, fcn_attr, buf);
+
+	spin_lock(&st->cache_lock);
+	if (max_age && st->cache_valid &&
+	    time_before(jiffies, st->cached_at + msecs_to_jiffies(max_age))) {
+		memcpy(mybuf, st->cache, st->cache_len);
+		hit = true;
+	}
+	gen = st->cache_gen;
+	spin_unlock(&st->cache_lock);
+
+	if (!hit) {
+		result = smartio_get_attr_value(fcn,
+						fcn_attr->attr_ix,
+						0xFF, /* No arrays for now */
+						mybuf,
+						&bytes_read);
+		if (result < 0)
+			return result;
+		spin_lock(&st->cache_lock);
+		/* Unless a write came in meanwhile */
+		if (max_age && (gen == st->cache_gen)) {
+			memcpy(st->cache, mybuf, bytes_read);
+			st->cache_len = bytes_read;
+			st->cached_at = jiffies;
+			st->cache_valid = true;
+		}
+		spin_unlock(&st->cache_lock);
+	}
 	smartio_raw_to_string(fcn_attr->type, mybuf, buf);
 	return strlen(buf);
 }
@@ -596,8 +2285,10 @@ static ssize_t store_fcn_attr(struct device *dev,
 {
 	char rawbuf[40];
 	int raw_len;
+	int status;
 	struct fcn_dev *fcn = container_of(dev, struct fcn_dev, dev);
 	struct fcn_attribute* fcn_attr = container_of(attr, struct fcn_attribute, dev_attr);
+	struct fcn_attr_state *st = &fcn->attr_state[fcn_attr->attr_ix];
 
        	dev_info(dev, "Calling store fcn for node %d, fcn %d, attr %s\n, ix %d,  value: %s\n", 
 		 dev->parent->id,
@@ -605,61 +2296,53 @@ static ssize_t store_fcn_attr(struct device *dev,
 		 attr->attr.name,
 		 fcn_attr->attr_ix,
 		 buf);
+	if (fcn_attr->arr_size > 1)
+		return store_fcn_array(fcn, fcn_attr, buf, count);
 	smartio_string_to_raw(fcn_attr->type, buf, rawbuf, &raw_len);
 	dev_info(dev, "rawbuf: %s, len: %d\n", rawbuf, raw_len);
-	smartio_set_attr_value(fcn,
-			       fcn_attr->attr_ix,
-			       0xFF, /* No arrays for now */
-			       rawbuf,
-			       raw_len);
-	return count;
+	status = smartio_set_attr_value(fcn,
+					fcn_attr->attr_ix,
+					0xFF, /* No arrays for now */
+					rawbuf,
+					raw_len,
+					st->combine_writes ?
+					&st->pending_set : NULL);
+	spin_lock(&st->cache_lock);
+	st->cache_valid = false;
+	st->cache_gen++;
+	spin_unlock(&st->cache_lock);
+	return (status < 0) ? status : count;
 }			    
 
 
-/* All attributes have to be allocated dynamically, as we do not
-   know in advance which attributes there are. This is a bit
-   unorthodox, leading to the usual DEVICE_ATTR macro being
-   a bit unusable.
+/* All attributes are set up at run time, as we do not know in
+   advance which attributes there are. This is a bit unorthodox,
+   leading to the usual DEVICE_ATTR macro being a bit unusable.
    To define a set of attributes in their own directory, just
    create an additional attribute group with a name (which will
    be the name of the directory). */
-static struct attribute *create_attr(const struct attr_info *cur_attr,
-				     const struct attr_info *head)
-{
-  const char* name = cur_attr->name;
-  bool readonly = cur_attr->input == 0;
-  int fcn_number = cur_attr - head;
-  int type = cur_attr->type;
-	char* name_cpy;
-	struct fcn_attribute *fcn_attr = kzalloc(sizeof *fcn_attr, GFP_KERNEL);
-	
-	if (!fcn_attr)
-		return NULL;
+static void init_fcn_attr(struct fcn_attribute *fcn_attr,
+			  const struct attr_info *info,
+			  int attr_ix)
+{
+	bool readonly = info->input == 0;
 
 	if (!readonly)
 	  fcn_attr->dev_attr.store = store_fcn_attr;
 	fcn_attr->dev_attr.attr.mode = readonly ? 0444 : 0644;
 	fcn_attr->dev_attr.show = show_fcn_attr;
-	fcn_attr->attr_ix = fcn_number;
-	fcn_attr->type = type;
-	name_cpy = kstrdup(name, GFP_KERNEL);
-	if (!name_cpy)
-		goto release_attr;
-	strcpy(name_cpy, name);
-	fcn_attr->dev_attr.attr.name = name_cpy;
-	sysfs_attr_init(fcn_attr->dev_attr.attr);
-	return &fcn_attr->dev_attr.attr;
-	
-release_attr:
-	kfree(fcn_attr);
-	return NULL;	
+	fcn_attr->dev_attr.attr.name = info->name;
+	fcn_attr->attr_ix = attr_ix;
+	fcn_attr->type = info->type;
+	fcn_attr->arr_size = info->arr_size;
+	sysfs_attr_init(&fcn_attr->dev_attr.attr);
 }
 
 
 
 /* Read the number of groups. Note that there always is at least
    one group; the default one. */
-static int get_no_of_groups(struct attr_info* info, int size)
+static int get_no_of_groups(const struct attr_info* info, int size)
 {
   int i;
   int count = 1;
@@ -670,233 +2353,217 @@ static int get_no_of_groups(struct attr_info* info, int size)
   return count;
 }
 
-static int get_no_of_attrs_in_group(const struct attr_info *attr, const struct attr_info * const end)
-{
-	int count = 0;
-
-	while ((attr != end) && (!attr->isDir)) {
-	  if (!attr->device) count++;
-	  attr++;
-	}
-
-	return count;
-}
 
-static int get_no_of_devs_in_group(const struct attr_info *attr, const struct attr_info * const end)
-{
-	int count = 0;
 
-	while ((attr != end) && (!attr->isDir)) {
-	  if (attr->device) count++;
-	  attr++;
-	}
 
-	return count;
-}
+/* The structure of the attribute group is:
+1) Each attribute is in a struct attribute
+2) Arrays of attributes are gathered in struct attribute_group. If a name
+   is given to the group, that shows up as an additional directory
+   in sysfs
+   3) The groups are gathered in an array.
+During introspection, information about each attribute is returned.
+If an attribute has "isDirectory" bit set, it will denote the 
+name of a group, and subsequent attributes until the next isDirectory
+item is put in that group. Attributes before the first directory
+go in the default group.
+Current limitations:
+  Only the first device attribute becomes a char device.
+  Attribute arrays are read and written whole, see show_fcn_array().
+*/
+/* Sysfs groups of a function type. Functions with the same name and
+   attribute table, on any node, share one template. It is immutable
+   once built; per function state is in fcn_dev->attr_state.
+   The attr_info arrays are zero filled when allocated, so they can be
+   hashed and compared as memory. */
+struct smartio_fcn_type {
+  struct hlist_node node;
+  struct kref ref;
+  u32 hash;
+  char name[SMARTIO_NAME_SIZE+1];
+  int no_of_attrs;
+  struct attr_info *info;
+  struct attribute_group **groups;
+  int dev_attr_ix; /* Attribute behind the char device, or -1 */
+};
 
+static DEFINE_HASHTABLE(fcn_types, 5);
+static DEFINE_MUTEX(fcn_types_lock);
 
-static void free_group(struct attribute_group *grp)
+static void smartio_release_fcn_type(struct kref *ref)
 {
-	if (grp->attrs) {
-		struct attribute** attr;
-
-		for (attr = grp->attrs; *attr != NULL; attr++) {
-			struct attribute *a = *attr;
-			struct device_attribute* d;
-
-#if 0				
-			pr_warn("Free: attr name %s\n", a->name);
-#endif
-			kfree(a->name);
-			d = container_of(a, struct device_attribute, attr);
-#if 0
-			pr_warn("Free: attribute\n");
-#endif
-			kfree(d);
-		}
-#if 0
-		pr_warn("Free: group attrs\n");
-#endif
-		kfree(grp->attrs);
-		grp->attrs = NULL;
-#if 0
-		pr_warn("Free: group name %s\n", grp->name);
-#endif
-		kfree(grp->name);
-		grp->name = NULL;
-	}
+	struct smartio_fcn_type *t = container_of(ref, struct smartio_fcn_type, ref);
 
+	hash_del(&t->node);
+	kfree(t); /* The whole arena */
 }
 
-
-static void free_groups(struct attribute_group** groups)
+static void smartio_put_fcn_type(struct smartio_fcn_type *t)
 {
-	while (*groups) {
-	  pr_warn("Free: group\n");
-	  free_group((struct attribute_group *) *groups);
-	  groups++;
-	}
+	mutex_lock(&fcn_types_lock);
+	kref_put(&t->ref, smartio_release_fcn_type);
+	mutex_unlock(&fcn_types_lock);
 }
 
-#if 0
-/* Debugging function to ensure we created the right structure */
-static void dump_group_tree(const struct attribute_group** groups)
+static void *arena_take(char **arena, size_t size)
 {
-  int g;
-  
+	void *p = *arena;
 
-  pr_warn("dumping group tree\n");
-  for (g=0; *groups != NULL; groups++, g++) {
-    struct attribute **attr = (*groups)->attrs;
-
-    pr_warn("group %d\n", g);
-    pr_warn("group ptr %p\n", *groups);
-    pr_warn("group name ptr %p\n", (*groups)->name);
-    pr_warn("group name:%s\n", (*groups)->name);
-    for (; *attr != 0; attr++) {
-      pr_warn("attrs ptr:%p\n", attr);
-      pr_warn("attr ptr:%p\n", *attr);
-      pr_warn("attr name:%s\n", (*attr)->name);
-      pr_warn("attr mode:%o\n", (unsigned int) (*attr)->mode);
-    }
-
-  }
+	*arena += ALIGN(size, sizeof(long));
+	return p;
 }
-#endif
 
-/* Create attributes for one group. If start is not a directory definition,
-   then this is the default group.
-   Returns pointer to the attribute after this group. That can be:
-      the definition of a new group
-      the end pointer when we are done
-      null for error */
-const struct attr_info *process_one_attr_group(const struct attr_info *head, 
-					       const struct attr_info *start, 
-					       const struct attr_info * const end,
-					       struct attribute_group * const grp,
-					       const struct attr_info **dev_attr)
-{
-	const struct attr_info *cur_attr = start;
+/* Build a new function type. The type and everything sysfs walks
+   for it are laid out in one allocation, in this order: the type, a
+   copy of the attribute table (whose names the attributes point
+   at), the group pointer array, the groups, the NULL terminated
+   attribute pointer arrays of all groups, and the fcn_attributes. */
+static struct smartio_fcn_type *
+smartio_new_fcn_type(struct smartio_node* node,
+		     const char *name,
+		     const struct attr_info *info,
+		     int no_of_attributes)
+{
+	const int no_of_groups = get_no_of_groups(info, no_of_attributes);
+	int no_of_files = 0;
+	struct smartio_fcn_type *t;
+	struct attribute_group *grp;
+	struct attribute **attrs;
+	struct fcn_attribute *fcn_attr;
+	size_t size;
+	char *arena;
 	int i;
-	int size = 0;
-	int no_of_devs = 0;
-
-	if (cur_attr->isDir) {
-	  	grp->name = kstrdup(cur_attr->name, GFP_KERNEL);
-		if (!grp->name) {
-			pr_err("Failed to allocate attribute name %s\n", cur_attr->name);
-			return NULL;
-		}
-		pr_warn("attr_group: found directory attribute\n");
-		cur_attr++;
+
+	for (i=0; i < no_of_attributes; i++)
+	  if (!info[i].isDir && !info[i].device)
+	    no_of_files++;
+
+	size = ALIGN(sizeof *t, sizeof(long)) +
+	  ALIGN(no_of_attributes * sizeof *info, sizeof(long)) +
+	  ALIGN((no_of_groups+1) * sizeof *t->groups, sizeof(long)) +
+	  ALIGN(no_of_groups * sizeof *grp, sizeof(long)) +
+	  ALIGN((no_of_files+no_of_groups) * sizeof *attrs, sizeof(long)) +
+	  ALIGN(no_of_files * sizeof *fcn_attr, sizeof(long));
+        dev_info(&node->dev, "Function type %s: %d groups, %zu bytes\n",
+		 name, no_of_groups, size);
+
+	arena = kzalloc(size, GFP_KERNEL);
+	if (!arena) {
+	  dev_err(&node->dev, "Failed to allocate function type %s\n", name);
+	  return NULL;
 	}
-	size = get_no_of_attrs_in_group(cur_attr, end);
-	no_of_devs = get_no_of_devs_in_group(cur_attr, end);
-	grp->attrs = kzalloc((sizeof grp->attrs) * (size + 1), GFP_KERNEL);
-	for (i=0; (cur_attr < end) && !cur_attr->isDir; i++, cur_attr++) {
-	  if (cur_attr->device && (*dev_attr == NULL)) {
-	    *dev_attr = cur_attr;
+	t = arena_take(&arena, sizeof *t);
+	t->info = arena_take(&arena, no_of_attributes * sizeof *info);
+	t->groups = arena_take(&arena, (no_of_groups+1) * sizeof *t->groups);
+	grp = arena_take(&arena, no_of_groups * sizeof *grp);
+	attrs = arena_take(&arena, (no_of_files+no_of_groups) * sizeof *attrs);
+	fcn_attr = arena_take(&arena, no_of_files * sizeof *fcn_attr);
+
+	kref_init(&t->ref);
+	strlcpy(t->name, name, sizeof t->name);
+	t->no_of_attrs = no_of_attributes;
+	t->dev_attr_ix = -1;
+	memcpy(t->info, info, no_of_attributes * sizeof *info);
+
+	/* Each group's attribute array ends with the NULL left by kzalloc */
+	t->groups[0] = grp;
+	grp->attrs = attrs;
+	for (i=0; i < no_of_attributes; i++) {
+	  const struct attr_info *cur_attr = &t->info[i];
+
+	  if (cur_attr->isDir) {
+	    attrs++;
+	    grp++;
+	    grp->name = cur_attr->name;
+	    grp->attrs = attrs;
+	    t->groups[grp - t->groups[0]] = grp;
+	  }
+	  else if (cur_attr->device) {
+	    if (t->dev_attr_ix < 0)
+	      t->dev_attr_ix = i;
 	  }
 	  else {
-	    grp->attrs[i] = create_attr(cur_attr, head);
-	    if (!grp->attrs[i]) {
-	      pr_err("process_one_attr_group: Failed to create attribute\n");
-	      goto cleanup;
-	    }
+	    init_fcn_attr(fcn_attr, cur_attr, i);
+	    *attrs++ = &fcn_attr->dev_attr.attr;
+	    fcn_attr++;
 	  }
 	}
-	return cur_attr;
-
- cleanup:
-	free_group(grp);
-	return NULL;
+	return t;
+}
+
+/* Find the type with this name and attribute table, or create it */
+static struct smartio_fcn_type *
+smartio_get_fcn_type(struct smartio_node* node,
+		     const char *name,
+		     const struct attr_info *info,
+		     int no_of_attributes)
+{
+	const size_t info_size = no_of_attributes * sizeof *info;
+	u32 hash = jhash(info, info_size, jhash(name, strlen(name), 0));
+	struct smartio_fcn_type *t;
+
+	mutex_lock(&fcn_types_lock);
+	hash_for_each_possible(fcn_types, t, node, hash)
+	  if ((t->hash == hash) && (t->no_of_attrs == no_of_attributes) &&
+	      !strcmp(t->name, name) && !memcmp(t->info, info, info_size)) {
+	    kref_get(&t->ref);
+	    goto unlock;
+	  }
+
+	t = smartio_new_fcn_type(node, name, info, no_of_attributes);
+	if (t) {
+	  t->hash = hash;
+	  hash_add(fcn_types, &t->node, hash);
+	}
+ unlock:
+	mutex_unlock(&fcn_types_lock);
+	return t;
 }
 
-
-
-
-/* The structure of the attribute group is:
-1) Each attribute is in a struct attribute
-2) Arrays of attributes are gathered in struct attribute_group. If a name
-   is given to the group, that shows up as an additional directory
-   in sysfs
-   3) The groups are gathered in an array.
-During introspection, information about each attribute is returned.
-If an attribute has "isDirectory" bit set, it will denote the 
-name of a group, and subsequent attributes until the next isDirectory
-item is put in that group.
-Current limitations:
-  Device nodes not handled.
-  Attribute arrays not handled. 
-*/
 static void
 define_function_attrs(struct smartio_node* node,
 		      struct fcn_dev *function_dev,
-		      int module,
+		      const char *name,
+		      const struct attr_info *info,
 		      int no_of_attributes)
 {
-	struct attr_info info[no_of_attributes];
-	const struct attr_info * const info_end = info + no_of_attributes;
-	const struct attr_info *info_current = info;
+	struct smartio_fcn_type *t;
 	int i;
-	int no_of_groups;	
-	struct attribute_group **groups = NULL;
 
 	dev_info(&node->dev, "define_function_attrs: entry\n");
 	dev_info(&node->dev, "define_function_attrs: attrs to process: %d\n", no_of_attributes);
+	function_dev->attr_state = kcalloc(no_of_attributes,
+					   sizeof *function_dev->attr_state,
+					   GFP_KERNEL);
+	if (!function_dev->attr_state) {
+	  dev_err(&node->dev, "Failed to allocate attribute state\n");
+	  return;
+	}
 	for (i=0; i < no_of_attributes; i++) {
-	  int res;
-
-	  dev_info(&node->dev, "processing attr ix: %d\n", i);
-	  res = smartio_get_attr_info(node, module, i, &info[i]);
-
-	  if (res != 0) {
-	    dev_err(&node->dev, "Failed reading attribute #%d\n", i);
-	    return;
-	  }
+	  spin_lock_init(&function_dev->attr_state[i].cache_lock);
+	  function_dev->attr_state[i].max_age_ms = -1;
 	}
 
-	no_of_groups = get_no_of_groups(info, no_of_attributes);
-        dev_info(&node->dev, "No of groups are: %d\n", no_of_groups);
-
-	/* Allocate array for group pointers and ending null pointer */
-	groups = kzalloc((sizeof *groups) * (no_of_groups+1), GFP_KERNEL);
-	if (!groups) {
-	  dev_err(&node->dev, "Failed to allocate groups array\n");
-	  goto fail_alloc_groups;
+	t = smartio_get_fcn_type(node, name, info, no_of_attributes);
+	if (!t) {
+	  kfree(function_dev->attr_state);
+	  function_dev->attr_state = NULL;
+	  return;
 	}
 
-	dev_info(&node->dev, "define_function_attrs: beginning to create groups\n");
-	for (i=0; i < no_of_groups; i++) {
-	  const struct attr_info *dev_attr = NULL;
+	if (t->dev_attr_ix >= 0) {
+	  const struct attr_info *dev_attr = &t->info[t->dev_attr_ix];
+	  int minor = get_minor_number(function_dev);
 
-	  if (!info_current) {
-	    dev_err(&node->dev, "Failed parsing group\n");
-	    goto cleanup;
-	  }
-	  groups[i] = kzalloc(sizeof *groups[i], GFP_KERNEL);
-	  if (!groups[i]) {
-	    dev_err(&node->dev, "Failed allocating a group\n");
-	    goto cleanup;
-	  }
-	  info_current = process_one_attr_group(info, info_current, info_end, 
-						groups[i], &dev_attr);
-	  if (dev_attr) {
-	    function_dev->dev.devt = MKDEV(major, get_minor_number());
-	    function_dev->devattr.type = dev_attr->type;
-	    function_dev->devattr.isInput = dev_attr->input;
-	    function_dev->devattr.attr_ix = dev_attr - info;
-	    dev_attr = NULL;
-	  }
+	  if (minor >= 0)
+	    function_dev->dev.devt = MKDEV(MAJOR(smartio_devt), minor);
+	  function_dev->devattr.type = dev_attr->type;
+	  function_dev->devattr.isInput = dev_attr->input;
+	  function_dev->devattr.attr_ix = t->dev_attr_ix;
 	}
-	function_dev->dev.groups = (const struct attribute_group**) groups;
-	return;
-
- cleanup:
-	free_groups(groups);
-	kfree(groups);
- fail_alloc_groups:
-	return;
+	function_dev->fcn_type = t;
+	function_dev->type_name = t->name;
+	function_dev->dev.groups = (const struct attribute_group**) t->groups;
 }
 
 #if 0
@@ -932,71 +2599,250 @@ static void free_attributes(struct device* dev)
 }
 #endif
 
-struct dev_match {
-  int id;
-  const char *devname;
-};
+/* The IDA numbering functions called name */
+static struct ida *smartio_fcn_ida(const char *name)
+{
+  u32 hash = jhash(name, strlen(name), 0);
+  struct smartio_fcn_ids *ids;
+
+  mutex_lock(&fcn_ids_lock);
+  hash_for_each_possible(fcn_ids, ids, node, hash)
+    if (!strcmp(ids->name, name))
+      goto unlock;
+
+  ids = kzalloc(sizeof *ids, GFP_KERNEL);
+  if (ids) {
+    ida_init(&ids->ida);
+    strlcpy(ids->name, name, sizeof ids->name);
+    hash_add(fcn_ids, &ids->node, hash);
+  }
+ unlock:
+  mutex_unlock(&fcn_ids_lock);
+  return ids ? &ids->ida : NULL;
+}
+
+static void smartio_free_fcn_ids(void)
+{
+  struct smartio_fcn_ids *ids;
+  struct hlist_node *tmp;
+  int bkt;
+
+  hash_for_each_safe(fcn_ids, bkt, tmp, ids, node) {
+    hash_del(&ids->node);
+    ida_destroy(&ids->ida);
+    kfree(ids);
+  }
+  ida_destroy(&node_ida);
+}
 
 
 
+/* The module index on the node of a function device. Function drivers
+   use it to address their own requests. */
+int smartio_function_index(struct device *dev)
+{
+  return container_of(dev, struct fcn_dev, dev)->function_ix;
+}
+EXPORT_SYMBOL_GPL(smartio_function_index);
 
 
-static int update_devid_if_match(struct device *dev, void *data)
+static ssize_t chardev_direction_show(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf)
 {
-  struct dev_match *info = data;
-  const char *name_to_test = dev_name(dev);
-  
-  if (!strncmp(info->devname, name_to_test, strlen(info->devname)) && 
-      isdigit(name_to_test[strlen(info->devname)])) {
-    info->id = max(info->id, (int) dev->id);
-  }
+  struct fcn_dev *fcn = container_of(dev, struct fcn_dev, dev);
 
-  return 0;
+  return scnprintf(buf, PAGE_SIZE, "%s\n",
+		   fcn->devattr.isInput ? "in" : "out");
 }
 
-static int get_highest_dev_id(const char *devname)
+/* Find an introspected attribute of a function by its name */
+static struct fcn_attribute *find_fcn_attr(struct device *dev, const char *name)
 {
-  struct dev_match data = { -1, devname };
+	const struct attribute_group **grp;
 
-  bus_for_each_dev(&smartio_bus, NULL, &data, update_devid_if_match);
+	for (grp = dev->groups; grp && *grp; grp++) {
+		struct attribute **attr;
 
-  return data.id;
+		for (attr = (*grp)->attrs; *attr != NULL; attr++)
+			if (!strcmp((*attr)->name, name))
+				return container_of(*attr, struct fcn_attribute,
+						    dev_attr.attr);
+	}
+	return NULL;
 }
 
 
+/* Shows the default cache lifetime of the function, followed by any
+   attributes having their own. */
+static ssize_t cache_max_age_show(struct device *dev,
+				  struct device_attribute *attr,
+				  char *buf)
+{
+  struct fcn_dev *fcn = container_of(dev, struct fcn_dev, dev);
+  const struct attribute_group **grp;
+  ssize_t len;
 
-static ssize_t chardev_direction_show(struct device *dev,
-				      struct device_attribute *attr,
-				      char *buf)
+  len = scnprintf(buf, PAGE_SIZE, "%u\n", fcn->cache_max_age_ms);
+  for (grp = dev->groups; grp && *grp; grp++) {
+    struct attribute **a;
+
+    for (a = (*grp)->attrs; *a != NULL; a++) {
+      struct fcn_attribute *fcn_attr =
+	container_of(*a, struct fcn_attribute, dev_attr.attr);
+      struct fcn_attr_state *st = &fcn->attr_state[fcn_attr->attr_ix];
+
+      if (st->max_age_ms >= 0)
+	len += scnprintf(buf + len, PAGE_SIZE - len, "%s %d\n",
+			 (*a)->name, st->max_age_ms);
+    }
+  }
+  return len;
+}
+
+/* "<ms>" sets the default of the function.
+   "<attr> <ms>" sets the lifetime of one attribute, and
+   "<attr> -1" makes it use the default again. */
+static ssize_t cache_max_age_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf,
+				   size_t count)
+{
+  struct fcn_dev *fcn = container_of(dev, struct fcn_dev, dev);
+  char name[SMARTIO_NAME_SIZE+1];
+  struct fcn_attribute *fcn_attr;
+  struct fcn_attr_state *st;
+  int ms;
+
+  if (sscanf(buf, "%20s %d", name, &ms) == 2) {
+    fcn_attr = find_fcn_attr(dev, name);
+    if (!fcn_attr || (ms < -1))
+      return -EINVAL;
+    st = &fcn->attr_state[fcn_attr->attr_ix];
+    spin_lock(&st->cache_lock);
+    st->max_age_ms = ms;
+    st->cache_valid = false;
+    spin_unlock(&st->cache_lock);
+  }
+  else if (kstrtouint(buf, 0, &fcn->cache_max_age_ms))
+    return -EINVAL;
+
+  return count;
+}
+
+/* Lists the writable attributes of the function and their write mode */
+static ssize_t write_mode_show(struct device *dev,
+			       struct device_attribute *attr,
+			       char *buf)
 {
   struct fcn_dev *fcn = container_of(dev, struct fcn_dev, dev);
+  const struct attribute_group **grp;
+  ssize_t len = 0;
 
-  return scnprintf(buf, PAGE_SIZE, "%s\n",
-		   fcn->devattr.isInput ? "in" : "out");
+  for (grp = dev->groups; grp && *grp; grp++) {
+    struct attribute **a;
+
+    for (a = (*grp)->attrs; *a != NULL; a++) {
+      struct fcn_attribute *fcn_attr =
+	container_of(*a, struct fcn_attribute, dev_attr.attr);
+
+      if (fcn_attr->dev_attr.store)
+	len += scnprintf(buf + len, PAGE_SIZE - len, "%s %s\n", (*a)->name,
+			 fcn->attr_state[fcn_attr->attr_ix].combine_writes ?
+			 "combine" : "strict");
+    }
+  }
+  return len;
+}
+
+static int parse_write_mode(const char *mode, bool *combine)
+{
+  if (sysfs_streq(mode, "combine"))
+    *combine = true;
+  else if (sysfs_streq(mode, "strict"))
+    *combine = false;
+  else
+    return -EINVAL;
+  return 0;
+}
+
+/* "<attr> combine|strict" sets the mode of one attribute,
+   "combine|strict" sets it for all writable attributes. */
+static ssize_t write_mode_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf,
+				size_t count)
+{
+  struct fcn_dev *fcn = container_of(dev, struct fcn_dev, dev);
+  char name[SMARTIO_NAME_SIZE+1];
+  char mode[10];
+  struct fcn_attribute *fcn_attr;
+  const struct attribute_group **grp;
+  bool combine;
+
+  if (sscanf(buf, "%20s %9s", name, mode) == 2) {
+    fcn_attr = find_fcn_attr(dev, name);
+    if (!fcn_attr || !fcn_attr->dev_attr.store ||
+	parse_write_mode(mode, &combine))
+      return -EINVAL;
+    fcn->attr_state[fcn_attr->attr_ix].combine_writes = combine;
+    return count;
+  }
+
+  if (parse_write_mode(buf, &combine))
+    return -EINVAL;
+  for (grp = dev->groups; grp && *grp; grp++) {
+    struct attribute **a;
+
+    for (a = (*grp)->attrs; *a != NULL; a++) {
+      fcn_attr = container_of(*a, struct fcn_attribute, dev_attr.attr);
+      if (fcn_attr->dev_attr.store)
+	fcn->attr_state[fcn_attr->attr_ix].combine_writes = combine;
+    }
+  }
+  return count;
 }
 
 #if (VERSION>=3) && (PATCHLEVEL>10)
 static DEVICE_ATTR_RO(chardev_direction);
+static DEVICE_ATTR_RW(cache_max_age);
+static DEVICE_ATTR_RW(write_mode);
 #else
 struct device_attribute dev_attr_chardev_direction = __ATTR_RO(chardev_direction);
+struct device_attribute dev_attr_cache_max_age =
+  __ATTR(cache_max_age, 0644, cache_max_age_show, cache_max_age_store);
+struct device_attribute dev_attr_write_mode =
+  __ATTR(write_mode, 0644, write_mode_show, write_mode_store);
 #endif
+struct attribute *function_attrs[] = {
+  &dev_attr_cache_max_age.attr,
+  &dev_attr_write_mode.attr,
+  NULL
+};
 struct attribute *chardev_function_attrs[] = {
   &dev_attr_chardev_direction.attr,
   NULL
 };
 
-#if (VERSION>=3) && (PATCHLEVEL>10)
-ATTRIBUTE_GROUPS(chardev_function);
-#else
+static const struct attribute_group function_group = {
+  .attrs = function_attrs,
+};
 static const struct attribute_group chardev_function_group = {
   .attrs = chardev_function_attrs,
 };
+static const struct attribute_group *function_groups[] = {
+  &function_group,
+  NULL,
+};
 static const struct attribute_group *chardev_function_groups[] = {
+  &function_group,
   &chardev_function_group,
   NULL,
 };
 
-#endif
+static struct device_type smartio_function = {
+  .groups = function_groups
+};
 
 static struct device_type smartio_chardev_function = {
   .groups = chardev_function_groups
@@ -1004,18 +2850,19 @@ static struct device_type smartio_chardev_function = {
 
 
 
+/* Build the device of one function, ready for add_function_device().
+   Instance numbers are handed out here, so this is done in module
+   order to keep the names stable. */
 static int create_function_device(struct smartio_node *node,
-				  int function_ix)
+				  int function_ix,
+				  const struct smartio_module_desc *mod,
+				  struct fcn_dev **fcn)
 {
-	char function_name[SMARTIO_NAME_SIZE+1];
-	int no_of_attributes;
-	int status;
+	const char *function_name = mod->name;
+	int no_of_attributes = mod->no_of_attrs;
+	int status = mod->status;
 	struct fcn_dev* function_dev = NULL;
 	
-	status = smartio_get_function_info(node, function_ix,
-					   &no_of_attributes,
-					   function_name);
-
 	if (!status) {
 		// Create a new device for this function
 		function_dev = kzalloc(sizeof *function_dev, GFP_KERNEL);
@@ -1028,6 +2875,7 @@ static int create_function_device(struct smartio_node *node,
 			goto done;
 		}
 		function_dev->function_ix = function_ix;
+		function_dev->cache_max_age_ms = cache_max_age_ms;
 		dev_warn(&node->dev, "Function name is %s\n", function_name);
 		dev_warn(&node->dev, "Function ix is %d\n", function_ix);
 		dev_warn(&node->dev, "Function has %d attributes\n",
@@ -1037,31 +2885,36 @@ static int create_function_device(struct smartio_node *node,
 		function_dev->dev.bus = &smartio_bus;
 		//      function_dev->dev.class = &smartio_function_class;
 		function_dev->dev.release = function_release;
+		status = -ENOMEM;
+		function_dev->ida = smartio_fcn_ida(function_name);
+		if (function_dev->ida)
+		  status = ida_simple_get(function_dev->ida, 0, 0, GFP_KERNEL);
+		if (status < 0) {
+			dev_err(&node->dev,
+				"No instance number for function %s\n",
+				function_name);
+			goto release_memory;
+		}
+		function_dev->dev.id = status;
+		status = 0;
 		define_function_attrs(node, 
 				      function_dev,
-				      function_ix,
+				      function_name,
+				      mod->info,
 				      no_of_attributes);
 		if (!function_dev->dev.groups) {
 			dev_err(&node->dev,
 				"Could not define function attrs\n");
-			goto release_memory;
+			goto release_id;
 		}
 		if (MAJOR(function_dev->dev.devt))
 		  function_dev->dev.type = &smartio_chardev_function;
-		function_dev->dev.id = get_highest_dev_id(function_name) + 1;
+		else
+		  function_dev->dev.type = &smartio_function;
 		dev_set_name(&function_dev->dev, "%s%d", function_name,
 			     (int) function_dev->dev.id);
-		status = device_register(&function_dev->dev);
-		if (status < 0) {
-			dev_err(&node->dev, 
-				"Failed to add function device %s\n",
-				function_name);
-			goto release_dev;
-		}
-		dev_info(&function_dev->dev, "MAJOR = %d, MINOR = %d\n", 
-			 MAJOR(function_dev->dev.devt), 
-			 MINOR(function_dev->dev.devt));
-
+		device_initialize(&function_dev->dev);
+		*fcn = function_dev;
 	}
 	else {
 		dev_err(&node->dev,
@@ -1070,9 +2923,8 @@ static int create_function_device(struct smartio_node *node,
 	}
 	goto done;
 	
-release_dev:
-	put_device(&function_dev->dev);
-	return status;
+release_id:
+	ida_simple_remove(function_dev->ida, function_dev->dev.id);
 release_memory:
 	kfree(function_dev);
 done:
@@ -1080,6 +2932,90 @@ done:
 }
 
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+/* Before 4.11, cdev_add() does not pin the parent of a cdev, and
+   __fput() drops the cdev after ->release() has dropped the function
+   around it. The cdev of a function then holds the function itself,
+   with a ktype adding that to the release cdev_init() sets up. */
+static struct kobj_type fcn_cdev_ktype;
+static void (*cdev_default_release)(struct kobject *kobj);
+
+static void fcn_cdev_release(struct kobject *kobj)
+{
+	struct fcn_dev *fcn = container_of(kobj, struct fcn_dev, cdev.kobj);
+
+	cdev_default_release(kobj);
+	put_device(&fcn->dev);
+}
+
+static void fcn_cdev_ktype_init(void)
+{
+	struct cdev cdev;
+
+	cdev_init(&cdev, &char_dev_fops);
+	fcn_cdev_ktype = *cdev.kobj.ktype;
+	cdev_default_release = fcn_cdev_ktype.release;
+	fcn_cdev_ktype.release = fcn_cdev_release;
+}
+#endif
+
+/* Drop a function from create_function_device() which was not added */
+static void drop_function_device(struct fcn_dev *function_dev)
+{
+	if (MAJOR(function_dev->dev.devt))
+		release_minor_number(MINOR(function_dev->dev.devt));
+	put_device(&function_dev->dev);
+}
+
+/* Make a function from create_function_device() visible. On failure
+   the function is dropped. */
+static int add_function_device(struct fcn_dev *function_dev)
+{
+	struct device *node_dev = function_dev->dev.parent;
+	int status;
+
+	/* The char device goes live before its /dev node shows up */
+	if (MAJOR(function_dev->dev.devt)) {
+		cdev_init(&function_dev->cdev, &char_dev_fops);
+		function_dev->cdev.owner = THIS_MODULE;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+		cdev_set_parent(&function_dev->cdev, &function_dev->dev.kobj);
+#else
+		function_dev->cdev.kobj.ktype = &fcn_cdev_ktype;
+#endif
+		status = cdev_add(&function_dev->cdev,
+				  function_dev->dev.devt, 1);
+		if (status < 0) {
+			dev_err(node_dev, "Failed to add char device of %s\n",
+				dev_name(&function_dev->dev));
+			goto release_minor;
+		}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+		/* Dropped by fcn_cdev_release() */
+		get_device(&function_dev->dev);
+#endif
+	}
+	/* Announced with the rest of the node, see smartio_enumerate_node() */
+	dev_set_uevent_suppress(&function_dev->dev, 1);
+	status = device_add(&function_dev->dev);
+	if (status < 0) {
+		dev_err(node_dev, "Failed to add function device %s\n",
+			dev_name(&function_dev->dev));
+		if (MAJOR(function_dev->dev.devt))
+			cdev_del(&function_dev->cdev);
+		goto release_minor;
+	}
+	dev_info(&function_dev->dev, "MAJOR = %d, MINOR = %d\n", 
+		 MAJOR(function_dev->dev.devt), 
+		 MINOR(function_dev->dev.devt));
+	return 0;
+
+release_minor:
+	drop_function_device(function_dev);
+	return status;
+}
+
+
 /*
   dev: the hardware device (i2c, spi, ...)
   node: the function bus controller device
@@ -1087,22 +3023,29 @@ done:
 static int smartio_register_node(struct device *dev, struct smartio_node *node, char *name)
 {
 	int status = -1;
+	int i;
 
 	device_initialize(&node->dev);
+	smartio_init_transactions(&node->transactions, window);
+	spin_lock_init(&node->tx_lock);
+	for (i = 0; i < SMARTIO_NR_PRIOS; i++)
+	  INIT_LIST_HEAD(&node->tx_queue[i]);
+	INIT_LIST_HEAD(&node->tx_expired);
+	kthread_init_work(&node->tx_work, wq_fcn_tx);
+	mutex_init(&node->io_lock);
+	mutex_init(&node->gets_lock);
+	hash_init(node->gets);
 	node->dev.parent = dev;
 	node->dev.bus = &smartio_bus;
 	node->dev.type = &controller_devt;
 
-	mutex_lock(&id_lock);
-	node->dev.id = get_highest_dev_id(smartio_bus.dev_name) + 1;
+	status = ida_simple_get(&node_ida, 0, 0, GFP_KERNEL);
+	if (status < 0)
+	  return status;
+	node->dev.id = status;
 	dev_info(dev, "Allocated node number %d\n", node->dev.id);
-	if (node->dev.id < 0) {
-	  mutex_unlock(&id_lock);
-	  return node->dev.id;
-	}
 	dev_set_drvdata(dev, node);
 	status = device_add(&node->dev);
-	mutex_unlock(&id_lock);
 	dev_info(dev, "Added node %s\n", dev_name(&node->dev));
 	if (status < 0) {
 		dev_err(dev, "Failed to add node device\n");
@@ -1116,16 +3059,16 @@ static int smartio_register_node(struct device *dev, struct smartio_node *node,
 
 static int dev_unregister_function(struct device* dev, void* null)
 {
-  dev_t devt;
+  struct fcn_dev *fcn = container_of(dev, struct fcn_dev, dev);
 
   dev_warn(dev, "Unregistering function %s\n", dev_name(dev));
-  /* Read the major/minor number now, just in case the struct device
-     is freed, alloced and overwritten by somebody else before
-     we can access it after unregistering. */
-  devt = dev->devt;
+  /* Stop new opens first. Open files keep the device alive through
+     the cdev, until they are closed. */
+  if (MAJOR(dev->devt)) {
+    cdev_del(&fcn->cdev);
+    release_minor_number(MINOR(dev->devt));
+  }
   device_unregister(dev);
-  if (MAJOR(devt))
-    release_minor_number(MINOR(devt));
   return 0;
 }
 
@@ -1213,55 +3156,125 @@ reclaim_node_memory:
 EXPORT_SYMBOL_GPL(dev_smartio_register_node);
 
 
-static int match_minor(struct device *dev, void *data)
+static void stream_release(struct kref *ref)
+{
+  struct smartio_stream *stream = container_of(ref, struct smartio_stream, ref);
+
+  vfree(stream->ring);
+  put_device(&stream->fcn_dev->dev);
+  kfree(stream);
+}
+
+/* The tail published by the reader, read once, and clamped so that
+   at most size bytes are in the ring. A bad tail only costs the
+   reader its data. */
+static u32 stream_tail(struct smartio_stream *stream, u32 head)
+{
+  u32 tail = READ_ONCE(stream->tail->tail);
+
+  if (head - tail > stream->size)
+    tail = head - stream->size;
+  return tail;
+}
+
+static u32 stream_used(struct smartio_stream *stream)
 {
-  int *minor = (int *) data;
+  const u32 head = READ_ONCE(stream->head);
 
-  return MAJOR(dev->devt) && (MINOR(dev->devt) == *minor);
+  return head - stream_tail(stream, head);
 }
 
+/* Append to the ring. Only called from poll completions, which the
+   io lock of the node serializes. */
+static void stream_produce(struct smartio_stream *stream,
+			   const uint8_t *src,
+			   u32 len)
+{
+  const u32 head = stream->head;
+  const u32 ofs = head & (stream->size - 1);
+  const u32 first = min(len, stream->size - ofs);
+
+  if (stream->size - (head - stream_tail(stream, head)) < len) {
+    stream->overruns += len;
+    WRITE_ONCE(stream->hdr->overruns, stream->overruns);
+    dev_err_ratelimited(&stream->fcn_dev->dev, "read ring overrun\n");
+    return;
+  }
+  memcpy(stream->data + ofs, src, first);
+  memcpy(stream->data, src + first, len - first);
+  /* The data must be in place before the reader sees the new head */
+  smp_wmb();
+  WRITE_ONCE(stream->head, head + len);
+  WRITE_ONCE(stream->hdr->head, head + len);
+  wake_up_interruptible(&stream->wait);
+}
 
 static void dev_read_completion_cb(struct smartio_comm_buf *req,
 				   struct smartio_comm_buf *resp,
 				   void *data)
 {
-  struct fcn_dev *dev = (struct fcn_dev *) data;
+  struct smartio_stream *stream = data;
 
-  if (kfifo_avail(&dev->fifo) < (resp->data_len-1)) {
-    dev_err(&dev->dev, "read fifo overrun\n");
-    goto free_buffers;
-  }
-  kfifo_in(&dev->fifo, resp->data + 1, resp->data_len-1);
- free_buffers:
-  kfree(req);
+  if (resp && (resp->data_len > 1))
+    stream_produce(stream, resp->data + 1, resp->data_len - 1);
+  smartio_free_comm_buf(req);
+  kref_put(&stream->ref, stream_release);
 }
 
 
 
 static void wq_fcn_dev_read(struct work_struct *w)
 {
-  struct smartio_devread_work *my_work = 
-    container_of(to_delayed_work(w), struct smartio_devread_work, work);
-  struct smartio_node *node = container_of(my_work->fcn_dev->dev.parent,
+  struct smartio_stream *stream =
+    container_of(to_delayed_work(w), struct smartio_stream, work);
+  struct fcn_dev *fcn_dev = stream->fcn_dev;
+  struct smartio_node *node = container_of(fcn_dev->dev.parent,
 					   struct smartio_node, 
 					   dev);
   struct smartio_comm_buf* tx;
-  int status;
 
-  tx = kzalloc(sizeof *tx, GFP_KERNEL);
+  tx = smartio_alloc_comm_buf(GFP_KERNEL);
   if (tx) { 
-    fillbuf_get_attr_value(tx, my_work->fcn_dev->function_ix,
-			   my_work->fcn_dev->devattr.attr_ix, 0xFF);
-    tx->cb_data = my_work->fcn_dev;
-    tx->cb = dev_read_completion_cb;
-
-    smartio_add_transaction(tx);
-    status = talk_to_node(node, tx);
+    fillbuf_get_attr_value(tx, fcn_dev->function_ix,
+			   fcn_dev->devattr.attr_ix, 0xFF);
+    tx->prio = SMARTIO_PRIO_BULK;
+    /* Each outstanding request holds the stream */
+    kref_get(&stream->ref);
+    if (smartio_submit_request(node, tx, dev_read_completion_cb, stream)) {
+      /* The node is gone; there is nothing more to read */
+      smartio_free_comm_buf(tx);
+      kref_put(&stream->ref, stream_release);
+      return;
+    }
   }
   else 
     pr_err("Failed to allocate dev read comms buffer\n");
 
-  queue_delayed_work(work_queue, &my_work->work, msecs_to_jiffies(1000));
+  schedule_delayed_work(&stream->work, msecs_to_jiffies(1000));
+}
+
+/* The ring is a header page and a tail page, followed by the data
+   pages. See smartio_ring.h. */
+#define RING_DATA_PAGE (SMARTIO_RING_TAIL_PAGE + 1)
+/* Keeps the ring size, and the mask made from it, well inside a u32 */
+#define RING_MAX_PAGES 1024U
+
+static int stream_alloc_ring(struct smartio_stream *stream)
+{
+  const unsigned int pages = clamp(READ_ONCE(ring_pages), 1U, RING_MAX_PAGES);
+  const u32 size = roundup_pow_of_two(pages) * PAGE_SIZE;
+
+  stream->ring = vmalloc_user(RING_DATA_PAGE * PAGE_SIZE + size);
+  if (!stream->ring)
+    return -ENOMEM;
+  stream->hdr = stream->ring + SMARTIO_RING_HDR_PAGE * PAGE_SIZE;
+  stream->tail = stream->ring + SMARTIO_RING_TAIL_PAGE * PAGE_SIZE;
+  stream->data = stream->ring + RING_DATA_PAGE * PAGE_SIZE;
+  stream->size = size;
+  stream->hdr->size = size;
+  stream->hdr->data_offset = RING_DATA_PAGE * PAGE_SIZE;
+  stream->hdr->tail_offset = SMARTIO_RING_TAIL_PAGE * PAGE_SIZE;
+  return 0;
 }
 
 static int dev_open(struct inode *i, struct file *filep)
@@ -1269,143 +3282,171 @@ static int dev_open(struct inode *i, struct file *filep)
   int minor = iminor(i);
   struct device *dev;
   struct fcn_dev *fcn_dev;
+  struct smartio_stream *stream;
 
   pr_info("char_dev: %s called for minor %d!\n", __func__, minor);
-  dev = bus_find_device(&smartio_bus, NULL, &minor, match_minor);
-
-  if (!dev) {
+  /* The opened cdev pins its function. Check that the minor still
+     belongs to it, and was not reused by a newer function. */
+  rcu_read_lock();
+  fcn_dev = find_minor_owner(minor);
+  if (fcn_dev && (&fcn_dev->cdev == i->i_cdev))
+    get_device(&fcn_dev->dev);
+  else
+    fcn_dev = NULL;
+  rcu_read_unlock();
+
+  if (!fcn_dev) {
     pr_err("%s: cannot open() as there is no matching device\n", __func__);
     return -ENODEV;
   }
+  dev = &fcn_dev->dev;
   pr_info("device: %s\n", dev_name(dev));
-  fcn_dev = container_of(dev, struct fcn_dev, dev);
+
+  stream = kzalloc(sizeof *stream, GFP_KERNEL);
+  if (!stream) {
+    dev_err(dev, "No memory for stream\n");
+    goto put_dev;
+  }
+  kref_init(&stream->ref);
+  stream->fcn_dev = fcn_dev;
+  init_waitqueue_head(&stream->wait);
+  INIT_DELAYED_WORK(&stream->work, wq_fcn_dev_read);
   
   if (filep->f_mode & FMODE_READ) {
-    if (kfifo_alloc(&fcn_dev->fifo, DEV_FIFO_SIZE, GFP_KERNEL)) {
-      dev_err(dev, "%s: failed to allocate memory for device kfifo buffer\n", __func__);
-      return -ENOMEM;
-    }
-    // Post deferred work
-    fcn_dev->devread_work = kmalloc(sizeof *fcn_dev->devread_work, GFP_KERNEL);
-    if (!fcn_dev->devread_work) {
-      dev_err(dev, "No memory for work item\n");
-      goto free_kfifo_mem;
-    }
-    INIT_DELAYED_WORK(&fcn_dev->devread_work->work, wq_fcn_dev_read);
-    fcn_dev->devread_work->fcn_dev = fcn_dev;
-    if (!queue_delayed_work(work_queue, &fcn_dev->devread_work->work, 0)) {
-      dev_err(dev, "Failed to queue work\n");
-      goto free_work;
+    if (stream_alloc_ring(stream)) {
+      dev_err(dev, "%s: failed to allocate memory for device ring buffer\n", __func__);
+      goto free_stream;
     }
+    /* Polled from the system workqueue, as an open file may outlive
+       the node worker */
+    schedule_delayed_work(&stream->work, 0);
   }
 
-  filep->private_data = fcn_dev;
+  filep->private_data = stream;
   return 0;
 
- free_work:
-  kfree(fcn_dev->devread_work);
- free_kfifo_mem:
-  kfifo_free(&fcn_dev->fifo);
+ free_stream:
+  kfree(stream);
+ put_dev:
+  put_device(dev);
   return -ENOMEM;
 }
 
 static int dev_release(struct inode *i, struct file *filep)
 {
-  struct fcn_dev *fcn_dev = (struct fcn_dev*) filep->private_data;
+  struct smartio_stream *stream = filep->private_data;
 
-  dev_info(&fcn_dev->dev, "%s called for minor %d!\n", __func__, iminor(i)); 
-  if (filep->f_mode & FMODE_READ) {
-    if (!cancel_delayed_work(&fcn_dev->devread_work->work))
-      flush_workqueue(work_queue);
-    kfree(fcn_dev->devread_work);
-    fcn_dev->devread_work = NULL;
-    kfifo_free(&fcn_dev->fifo);
-  }
+  dev_info(&stream->fcn_dev->dev, "%s called for minor %d!\n", __func__, iminor(i)); 
+  if (stream->ring)
+    cancel_delayed_work_sync(&stream->work);
+  /* Polls still outstanding drop the last references */
+  kref_put(&stream->ref, stream_release);
 
   return 0;
 }
 
 
+/* Map the ring, see smartio_ring.h. All but the tail page are read
+   only. */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+  struct smartio_stream *stream = filep->private_data;
+
+  if (!stream->ring || (vma->vm_flags & VM_EXEC))
+    return -EINVAL;
+  if (vma->vm_flags & VM_WRITE) {
+    if ((vma->vm_pgoff != SMARTIO_RING_TAIL_PAGE) ||
+	(vma_pages(vma) != 1) || !(vma->vm_flags & VM_SHARED))
+      return -EPERM;
+  }
+  else {
+    /* Nor may it be made writable later */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+  vm_flags_clear(vma, VM_MAYEXEC);
+#else
+  vma->vm_flags &= ~VM_MAYEXEC;
+#endif
+  return remap_vmalloc_range(vma, stream->ring, vma->vm_pgoff);
+}
+
+static unsigned int dev_poll(struct file *filep, poll_table *wait)
+{
+  struct smartio_stream *stream = filep->private_data;
+  unsigned int mask = 0;
+
+  if (filep->f_mode & FMODE_WRITE)
+    mask |= POLLOUT | POLLWRNORM;
+  if (stream->ring) {
+    poll_wait(filep, &stream->wait, wait);
+    if (stream_used(stream))
+      mask |= POLLIN | POLLRDNORM;
+  }
+  return mask;
+}
 
 
 /* The read will continue until the requested count has been reached
    before returning.
-   Whenever something is present in the kfifo, it is copied to the user-space
-   buffer. 
-   When there is nothing in the kfifo, the function sleeps. */
+   Whenever something is present in the ring, it is copied to the
+   user-space buffer. 
+   When there is nothing in the ring, the function sleeps. */
 static ssize_t dev_read(struct file *filep, char __user *buf, size_t count, loff_t *ppos)
 {
-  struct fcn_dev *fcn_dev = (struct fcn_dev*) filep->private_data;
+  struct smartio_stream *stream = filep->private_data;
+  size_t bytes_left = count;
 
-  int bytes_left = count;
-  int bytes_available;
-
-  pr_info("%s called!\n", __func__);
-  pr_info("len: %d, ofs: %d\n", (int) count, (int) *ppos);
-  pr_info("device: %s\n", dev_name(&fcn_dev->dev));
-#if 0
-  pr_info("input: %s\n", fcn_dev->devattr.isInput ? "yes" : "no");
-  pr_info("attr ix = %d\n", fcn_dev->devattr.attr_ix);
-  pr_info("type = %d\n", fcn_dev->devattr.type);
-#endif
-
-  if (*ppos < 0)
+  if (!stream->ring || (*ppos < 0))
     return -EINVAL;
   if (!count)
     return 0;
 
   while (bytes_left > 0) {
-    if (kfifo_is_empty(&fcn_dev->fifo)) {
-      int status;
-      const int fifo_threshold = kfifo_size(&fcn_dev->fifo) / 2;
-
-      dev_info(&fcn_dev->dev,"Fifo empty; sleeping\n");
-      status = wait_event_interruptible(wait_queue, 
-					kfifo_len(&fcn_dev->fifo) >= 
-					min(bytes_left, fifo_threshold));
-      dev_info(&fcn_dev->dev,"Fifo no longer empty; woke up\n");
-      if (status == 0) {
-#ifdef DBG_WORK
-	dev_info(&fcn_dev->dev, "Woke up after request\n");
-#endif
-      }
-      else {
-	dev_info(&fcn_dev->dev, "%s: Received a signal\n", __func__);
-	// TBD: handle signal interruption correctly
-	return -EFAULT; 
+    u32 head, tail, ofs, bytes_to_read, first;
+
+    if (!stream_used(stream)) {
+      const u32 threshold = min_t(size_t, bytes_left, stream->size / 2);
+
+      if (wait_event_interruptible(stream->wait,
+				   stream_used(stream) >= threshold)) {
+	dev_info(&stream->fcn_dev->dev, "%s: Received a signal\n", __func__);
+	break;
       }
     }
 
-    dev_info(&fcn_dev->dev, "About to read from fifo\n");
-    bytes_available = kfifo_len(&fcn_dev->fifo);
-    if (bytes_available  > 0) {
-      int bytes_to_read = min(bytes_available, bytes_left);
-      int bytes_read;
-    
-      dev_info(&fcn_dev->dev, "bytes in fifo: %d\n", bytes_available);
-      dev_info(&fcn_dev->dev, "bytes left: %d\n", bytes_left);
-      dev_info(&fcn_dev->dev, "bytes to read: %d\n", bytes_to_read);
-      if (kfifo_to_user(&fcn_dev->fifo, 
-			buf + count - bytes_left, 
-			bytes_to_read,
-			&bytes_read) < 0) {
-	dev_err(&fcn_dev->dev, "%s: Failed to read from kfifo\n", __func__);
-	return -EFAULT;
-      }
-      bytes_left -= bytes_read;
-      *ppos += bytes_read;
-    };
-    dev_info(&fcn_dev->dev, "Done (for now) reading from fifo\n");
+    /* Read head before the data it covers */
+    head = READ_ONCE(stream->head);
+    smp_rmb();
+    tail = stream_tail(stream, head);
+    bytes_to_read = min_t(size_t, head - tail, bytes_left);
+    ofs = tail & (stream->size - 1);
+    first = min(bytes_to_read, stream->size - ofs);
+    if (copy_to_user(buf + count - bytes_left, stream->data + ofs, first) ||
+	copy_to_user(buf + count - bytes_left + first, stream->data,
+		     bytes_to_read - first)) {
+      dev_err(&stream->fcn_dev->dev, "%s: Failed to read from ring\n", __func__);
+      return -EFAULT;
+    }
+    /* Done with the data before the producer may reuse it */
+    smp_mb();
+    WRITE_ONCE(stream->tail->tail, tail + bytes_to_read);
+    bytes_left -= bytes_to_read;
+    *ppos += bytes_to_read;
   }
-  return count - bytes_left;
+  return (bytes_left == count) ? -ERESTARTSYS : count - bytes_left;
 }
 
 
-
 static ssize_t dev_write(struct file *filep, const char __user *buf, 
 			 size_t count, loff_t *ppos)
 {
-  struct fcn_dev *fcn_dev = (struct fcn_dev*) filep->private_data;
+  struct smartio_stream *stream = filep->private_data;
+  struct fcn_dev *fcn_dev = stream->fcn_dev;
   char rawbuf[ATTR_MAX_PAYLOAD];
 
   int bytes_left = count;
@@ -1434,7 +3475,8 @@ static ssize_t dev_write(struct file *filep, const char __user *buf,
 			   fcn_dev->devattr.attr_ix,
 			   0xFF, /* No arrays for now */
 			   rawbuf,
-			   bytes_to_send);
+			   bytes_to_send,
+			   NULL);
     bytes_left -= bytes_to_send;
   } while (bytes_left > 0);
 
@@ -1447,51 +3489,205 @@ static struct file_operations char_dev_fops = {
   .open = dev_open,
   .read = dev_read,
   .write = dev_write,
+  .mmap = dev_mmap,
+  .poll = dev_poll,
   .release = dev_release
 };
 
 
 int smartio_add_driver(struct smartio_driver* sd)
 {
+  int status;
+
   sd->driver.bus = &smartio_bus;
-  return driver_register(&sd->driver);
+  status = smartio_add_ids(sd);
+  if (status)
+    return status;
+  status = driver_register(&sd->driver);
+  if (status)
+    smartio_del_ids(&sd->driver);
+  return status;
 }
 EXPORT_SYMBOL_GPL(smartio_add_driver);
 
 void smartio_del_driver(struct smartio_driver* sd)
 {
   driver_unregister(&sd->driver);
+  smartio_del_ids(&sd->driver);
 }
 EXPORT_SYMBOL_GPL(smartio_del_driver);
 
 
 
-static int fcn_ctrl_probe(struct device* dev)
+/* The bus controller driver probes asynchronously, so a slow node
+   does not hold up the others. The functions of a node are added in
+   parallel; the node is usable meanwhile. */
+static ASYNC_DOMAIN_EXCLUSIVE(smartio_async);
+
+struct smartio_enum {
+  struct smartio_introspection intro;
+  struct fcn_dev **fcns; /* Built functions, not yet added */
+  atomic_t next; /* Next of fcns to add */
+  atomic_t pending;
+  struct completion done;
+  int status; /* Of a function which could not be added */
+};
+
+static void smartio_add_function_async(void *data, async_cookie_t cookie)
+{
+  struct smartio_enum *e = data;
+  int k = atomic_inc_return(&e->next) - 1;
+  int status;
+
+  status = add_function_device(e->fcns[k]);
+  if (status) {
+    e->fcns[k] = NULL; /* Dropped */
+    WRITE_ONCE(e->status, status);
+  }
+  if (atomic_dec_and_test(&e->pending))
+    complete(&e->done);
+}
+
+/* Introspect the node and add its functions. On failure, none of
+   them are left. */
+static int smartio_enumerate_node(struct smartio_node *node)
 {
+  static char *ready_env[] = { "SMARTIO_EVENT=ready", NULL };
+  struct device *dev = &node->dev;
   int status = 0;
   int no_of_modules = 0;
   char node_name[30];
   int i;
-  struct smartio_node *node;  
+  int no_of_fcns = 0;
+  struct smartio_enum *e;
+  u32 hash;
+  bool hash_valid;
 
-  node = container_of(dev, struct smartio_node, dev);
-  dev_info(dev, "Bus probe for function bus controller driver\n");
-  dev_info(dev, "Parent dev name is %s\n", dev_name(dev->parent));
   no_of_modules = smartio_get_no_of_modules(node, node_name);
   dev_info(dev, "Node has %d modules\n", no_of_modules);
   dev_info(dev, "Name read from device is %s\n", node_name);
 
   if (no_of_modules < 0)
-    return -EINVAL;
+    return no_of_modules;
+
+  e = kzalloc(sizeof *e, GFP_KERNEL);
+  if (!e)
+    return -ENOMEM;
+  status = -ENOMEM;
+  e->intro.node = node;
+  e->intro.no_of_modules = no_of_modules;
+  e->intro.modules = kcalloc(no_of_modules, sizeof *e->intro.modules,
+			     GFP_KERNEL);
+  e->fcns = kcalloc(no_of_modules, sizeof *e->fcns, GFP_KERNEL);
+  if (!e->intro.modules || !e->fcns)
+    goto free_enum;
+
+  hash_valid = desc_cache && !smartio_get_desc_hash(node, &hash);
+  if (hash_valid && !smartio_load_desc(&e->intro, hash))
+    dev_info(dev, "Using known descriptor %08x\n", hash);
+  else {
+    status = smartio_introspect(&e->intro);
+    if (status) {
+      dev_err(dev, "Failed introspecting node\n");
+      goto free_intro;
+    }
+    if (hash_valid)
+      smartio_save_desc(&e->intro, hash);
+  }
 
   for (i=1; i < no_of_modules; i++) {
-    status = create_function_device(node, i);
+    struct fcn_dev *fcn = NULL;
+
+    status = create_function_device(node, i, &e->intro.modules[i], &fcn);
     if (status) {
       dev_err(dev, "Failed creating function %d of %d\n", i, no_of_modules);
-      return status;
+      while (no_of_fcns > 0)
+	drop_function_device(e->fcns[--no_of_fcns]);
+      goto free_intro;
     }
+    if (fcn)
+      e->fcns[no_of_fcns++] = fcn;
+  }
+
+  atomic_set(&e->pending, 1);
+  init_completion(&e->done);
+  for (i=0; i < no_of_fcns; i++) {
+    atomic_inc(&e->pending);
+    async_schedule_domain(smartio_add_function_async, e, &smartio_async);
+  }
+  if (!atomic_dec_and_test(&e->pending))
+    wait_for_completion(&e->done);
+
+  status = e->status;
+  if (status) {
+    dev_err(dev, "Failed adding functions\n");
+    for (i=0; i < no_of_fcns; i++)
+      if (e->fcns[i])
+	dev_unregister_function(&e->fcns[i]->dev, NULL);
+    goto free_intro;
   }
+  dev_info(dev, "Node enumerated, %d functions\n", no_of_fcns);
+
+  /* Let udev see the populated node in one go. A driver which bound
+     meanwhile had its BIND held back too; the device lock keeps a
+     binding in progress from slipping between the two. */
+  for (i=0; i < no_of_fcns; i++) {
+    struct device *fcn_dev = &e->fcns[i]->dev;
+
+    device_lock(fcn_dev);
+    dev_set_uevent_suppress(fcn_dev, 0);
+    kobject_uevent(&fcn_dev->kobj, KOBJ_ADD);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+    if (fcn_dev->driver)
+      kobject_uevent(&fcn_dev->kobj, KOBJ_BIND);
+#endif
+    device_unlock(fcn_dev);
+  }
+  kobject_uevent_env(&dev->kobj, KOBJ_CHANGE, ready_env);
+
+ free_intro:
+  smartio_free_introspection(&e->intro);
+  e->intro.modules = NULL;
+ free_enum:
+  kfree(e->intro.modules);
+  kfree(e->fcns);
+  kfree(e);
+  return status;
+}
+
+/* Fail what the node still has, and stop its worker */
+static void smartio_node_offline(struct smartio_node *node)
+{
+  /* Their timers would otherwise fire on a node which is gone */
+  smartio_fail_requests(node);
+  /* Runs what is queued, then stops the thread. Here rather than in
+     the node release, which may run on the worker itself when the
+     last reference goes away there. */
+  smartio_destroy_worker(node->worker);
+  node->worker = NULL;
+}
+
+static int fcn_ctrl_probe(struct device* dev)
+{
+  struct smartio_node *node = to_node(dev);
+  int status;
+
+  dev_info(dev, "Bus probe for function bus controller driver\n");
+  dev_info(dev, "Parent dev name is %s\n", dev_name(dev->parent));
 
+  node->worker = smartio_create_worker(node->dev.id);
+  if (IS_ERR(node->worker)) {
+    status = PTR_ERR(node->worker);
+    node->worker = NULL;
+    dev_err(dev, "Failed to create node worker, error %d\n", status);
+    return status;
+  }
+  node->online = true;
+  status = smartio_enumerate_node(node);
+  if (status) {
+    dev_err(dev, "Failed enumerating node, error %d\n", status);
+    smartio_node_offline(node);
+  }
   return status;
 }
 
@@ -1503,6 +3699,7 @@ static int fcn_ctrl_remove(struct device* dev)
   dev_info(dev, "About to unregister child functions\n");
   status =  device_for_each_child(dev, NULL, dev_unregister_function);
   dev_info(dev, "Done unregistering child functions\n");
+  smartio_node_offline(to_node(dev));
 
   return status;
 }
@@ -1519,6 +3716,9 @@ static struct smartio_driver fcn_ctrl_driver = {
     .bus = &smartio_bus,
     .probe = fcn_ctrl_probe,
     .remove = fcn_ctrl_remove,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+    .probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
   },
   .id_table = fcn_ctrl_table,
 };
@@ -1542,19 +3742,37 @@ static int __init my_init(void)
     goto fail_function_class_register;
   }
 
-  work_queue = create_singlethread_workqueue(smartio_bus.name);
-  if (work_queue == NULL) {
-    pr_err("smartio: Failed to create workqueue\n");
-    goto fail_workqueue;
+  if (smartio_comm_buf_init() < 0) {
+    pr_err("smartio: Failed to create comm buffer pool\n");
+    goto fail_comm_buf_pool;
+  }
+
+  work_cache = KMEM_CACHE(smartio_work, 0);
+  if (!work_cache) {
+    pr_err("smartio: Failed to create work item cache\n");
+    goto fail_work_cache;
+  }
+  work_pool = mempool_create_slab_pool(WORK_RESERVE, work_cache);
+  if (!work_pool) {
+    pr_err("smartio: Failed to create work item pool\n");
+    goto fail_work_pool;
+  }
+
+  pending_get_cache = KMEM_CACHE(smartio_pending_get, 0);
+  if (!pending_get_cache) {
+    pr_err("smartio: Failed to create pending get cache\n");
+    goto fail_pending_get_cache;
   }
 
-  if (driver_register(&fcn_ctrl_driver.driver) < 0) {
+  if (smartio_add_driver(&fcn_ctrl_driver) < 0) {
     pr_err("smartio: Failed to register function bus controller driver\n");
     goto fail_bus_driver;
   }
 
-  major = register_chrdev(0, "smartio", &char_dev_fops);
-  if (major < 0) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+  fcn_cdev_ktype_init();
+#endif
+  if (alloc_chrdev_region(&smartio_devt, 0, SMARTIO_MINORS, "smartio") < 0) {
     pr_err("smartio: Failed to allocate major number\n");
     goto fail_major_number;
   }
@@ -1563,10 +3781,16 @@ static int __init my_init(void)
   return 0;
 
  fail_major_number:
-  driver_unregister(&fcn_ctrl_driver.driver);
+  smartio_del_driver(&fcn_ctrl_driver);
  fail_bus_driver:
-  destroy_workqueue(work_queue);
-fail_workqueue:
+  kmem_cache_destroy(pending_get_cache);
+ fail_pending_get_cache:
+  mempool_destroy(work_pool);
+fail_work_pool:
+  kmem_cache_destroy(work_cache);
+fail_work_cache:
+  smartio_comm_buf_exit();
+fail_comm_buf_pool:
   class_unregister(&smartio_function_class);
 fail_function_class_register:
 #if 0
@@ -1581,9 +3805,15 @@ module_init(my_init);
 
 static void __exit my_cleanup(void)
 {
-  unregister_chrdev(major, "smartio");
-  driver_unregister(&fcn_ctrl_driver.driver);
-  destroy_workqueue(work_queue);
+  unregister_chrdev_region(smartio_devt, SMARTIO_MINORS);
+  minor_id_exit();
+  smartio_del_driver(&fcn_ctrl_driver);
+  smartio_free_desc_blobs();
+  smartio_free_fcn_ids();
+  kmem_cache_destroy(pending_get_cache);
+  mempool_destroy(work_pool);
+  kmem_cache_destroy(work_cache);
+  smartio_comm_buf_exit();
   class_unregister(&smartio_function_class);
 #if 0
   class_unregister(&smartio_node_class);
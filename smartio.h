@@ -1,4 +1,11 @@
 #include <linux/device.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/hashtable.h>
+
+#include "comm_buf.h"
+#include "txbuf_list.h"
 
 
 // Put the following in include/linux/mod_devicetable.h
@@ -26,6 +33,24 @@ void smartio_del_driver(struct smartio_driver* sd);
 
 struct smartio_node {
   struct device dev;
+  struct smartio_trans_table transactions;
+  /* Requests waiting for a free slot in the transaction window,
+     one queue per priority class */
+  spinlock_t tx_lock;
+  struct list_head tx_queue[SMARTIO_NR_PRIOS];
+  unsigned int tx_passed[SMARTIO_NR_PRIOS]; /* Starvation guard */
+  struct list_head tx_expired; /* Requests whose deadline has passed */
+  bool online; /* Taking requests; cleared when the node goes away */
+  bool no_desc_hash; /* Node does not answer GET_DESC_HASH */
+  bool no_multi; /* Node does not know GET_MULTI and SET_MULTI */
+  bool no_get_string; /* Node does not answer GET_STRING */
+  struct kthread_work tx_work;
+  struct kthread_worker *worker; /* Task "smartio<id>", while bound */
+  /* Serializes communicate() and the handling of responses */
+  struct mutex io_lock;
+  /* Attribute GETs in flight, shared by concurrent readers */
+  struct mutex gets_lock;
+  DECLARE_HASHTABLE(gets, 4);
   // Send a message, and receive one.
   // tx may be null, in which case the remote node is polled.
   // rx may be empty, if remote node returned no data.
@@ -48,6 +73,15 @@ int smartio_unregister_node(struct device *dev, void* null);
 
 int smartio_get_no_of_modules(struct smartio_node* node, char* name);
 
+/* Asynchronous requests for function drivers. See smartio-core.c */
+int smartio_submit_request(struct smartio_node *node,
+			   struct smartio_comm_buf *buf,
+			   smartio_tx_completion_cb cb,
+			   void *data);
+bool smartio_cancel_request(struct smartio_node *node,
+			    struct smartio_comm_buf *buf);
+int smartio_function_index(struct device *dev);
+
 /* Used by node drivers to send unsolicited messages back */
 void handle_indication(struct smartio_node *node, struct smartio_comm_buf *ind);
 
@@ -109,5 +143,24 @@ enum smartio_status {
 #define IO_IS_DIR 0x10
 #define ATTR_MAX_PAYLOAD (SMARTIO_DATA_SIZE - 5)
 
+/* One value in a batch for smartio_get_attr_values() and
+   smartio_set_attr_values(). The node fills in status, and for gets
+   also len and data. */
+struct smartio_attr_value {
+  uint8_t module;
+  uint16_t attr;
+  uint8_t array;
+  uint8_t status; /* enum smartio_status */
+  uint8_t len;
+  uint8_t data[ATTR_MAX_PAYLOAD];
+};
+
+int smartio_get_attr_values(struct smartio_node *node,
+			    struct smartio_attr_value *values,
+			    int n);
+int smartio_set_attr_values(struct smartio_node *node,
+			    struct smartio_attr_value *values,
+			    int n);
+
 
 extern struct bus_type smartio_bus;
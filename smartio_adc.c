@@ -10,6 +10,10 @@ static const struct smartio_device_id my_idtable[] = {
 
 
 MODULE_DEVICE_TABLE(smartio, my_idtable);
+/* modpost does not know smartio tables; spell out the aliases the
+   bus sends in MODALIAS so that the driver is loaded on demand */
+MODULE_ALIAS("smartio:adc");
+MODULE_ALIAS("smartio:dac");
 
 
 
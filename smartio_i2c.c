@@ -338,23 +338,75 @@ static int communicate(struct smartio_node* this,
 #endif
 
 
+/* As the smbus alert interrupt is handled by iterating over the
+   adapter's children, and the device is not added to that list until
+   after probing is done, the node is registered once the client shows
+   up there and the node answers a quick ping. Until then we poll,
+   backing off from READY_FIRST_DELAY_MS. */
+#define READY_FIRST_DELAY_MS 5
+#define READY_MAX_DELAY_MS 500
+#define READY_MAX_TRIES 16
+
 struct smartio_devcreate_work {
   struct delayed_work work;
-  struct device* i2c_dev; 
+  struct i2c_client *client;
+  unsigned int delay_ms;
+  int tries;
 };
 
+static int match_client(struct device *dev, void *data)
+{
+  return dev == data;
+}
+
+static bool node_is_ready(struct i2c_client *client)
+{
+  struct device *found;
+
+  found = device_find_child(&client->adapter->dev, &client->dev, match_client);
+  if (!found)
+    return false;
+  put_device(found);
+  if (!client->dev.driver)
+    return false;
+
+  if (!i2c_check_functionality(client->adapter, I2C_FUNC_SMBUS_QUICK))
+    return true;
+  return i2c_smbus_xfer(client->adapter, client->addr, client->flags,
+			I2C_SMBUS_WRITE, 0, I2C_SMBUS_QUICK, NULL) >= 0;
+}
+
 static void wq_fcn_dev_create(struct work_struct *w)
 {
   struct smartio_devcreate_work *my_work = 
     container_of(to_delayed_work(w), struct smartio_devcreate_work, work);
+  struct i2c_client *client = my_work->client;
   int status;
 
-  pr_info("Delayed creation of smartio node under device %s\n",
-	  dev_name(my_work->i2c_dev));
-  status = dev_smartio_register_node(my_work->i2c_dev,
+  if (!node_is_ready(client)) {
+    if (++my_work->tries < READY_MAX_TRIES) {
+      queue_delayed_work(system_long_wq, &my_work->work,
+			 msecs_to_jiffies(my_work->delay_ms));
+      my_work->delay_ms = min_t(unsigned int, my_work->delay_ms * 2,
+				 READY_MAX_DELAY_MS);
+      return;
+    }
+    dev_err(&client->dev, "Node not ready, registering anyway\n");
+  }
+
+  pr_info("Creation of smartio node under device %s after %d tries\n",
+	  dev_name(&client->dev), my_work->tries + 1);
+  status = dev_smartio_register_node(&client->dev,
 				     "smartio-i2c",
 				     communicate);
-  kfree(my_work);
+}
+
+/* The work item is managed, so it is stopped when the client goes */
+static void devcreate_release(struct device *dev, void *res)
+{
+  struct smartio_devcreate_work *my_work = res;
+
+  cancel_delayed_work_sync(&my_work->work);
 }
 
 
@@ -372,20 +424,18 @@ static int my_probe(struct i2c_client* client,
 
   dev_info(&client->dev, "Probing smart i2c driver\n");
 
-  // As the smbus alert interrupt is handled by iterating over the
-  // adapter's children, and the device is not added to that
-  // list until after probing is done, we need to delay
-  // the creation of sub-nodes.
   //  status = devm_smartio_register_node(&client->dev);
-  my_work = kmalloc(sizeof *my_work, GFP_KERNEL);
+  my_work = devres_alloc(devcreate_release, sizeof *my_work, GFP_KERNEL);
   if (!my_work) {
     dev_err(&client->dev, "No memory for work item\n");
     return -1;
   }
   INIT_DELAYED_WORK(&my_work->work, wq_fcn_dev_create);
-  my_work->i2c_dev = &client->dev;
+  my_work->client = client;
+  my_work->delay_ms = READY_FIRST_DELAY_MS;
+  devres_add(&client->dev, my_work);
 
-  queue_delayed_work(system_long_wq, &my_work->work, msecs_to_jiffies(1000));
+  queue_delayed_work(system_long_wq, &my_work->work, 0);
   pr_warn("Probe status was %d\n", status);
 
   return status; 
@@ -394,8 +444,13 @@ static int my_probe(struct i2c_client* client,
 static int my_remove(struct i2c_client* client)
 {
   int status;
+  struct smartio_devcreate_work *my_work;
 
   pr_info("Removing smart i2c driver\n");
+  /* No node may be registered after this */
+  my_work = devres_find(&client->dev, devcreate_release, NULL, NULL);
+  if (my_work)
+    cancel_delayed_work_sync(&my_work->work);
   status = device_for_each_child(&client->dev, NULL, smartio_unregister_node);
   return 0;
 }
@@ -410,7 +465,7 @@ static int poll_slave(struct i2c_client *client)
 {
   char rbuf[32];
   int result;
-  struct smartio_comm_buf* rx = kzalloc(sizeof *rx, GFP_KERNEL);
+  struct smartio_comm_buf* rx = smartio_alloc_comm_buf(GFP_KERNEL);
   struct device *smartio_dev = device_find_child(&client->dev, NULL, matchall);
 
   if (!rx) {
@@ -445,7 +500,7 @@ static int poll_slave(struct i2c_client *client)
   return 0;
 
  release_commbuf:
-  kfree(rx);
+  smartio_free_comm_buf(rx);
   return -1;
 }
 
@@ -5,8 +5,8 @@
 
 inline void smartio_set_msg_type(struct smartio_comm_buf* buf, int t)
 {
-  buf->transport_header &= (~(MY_SIZE2MASK(SMARTIO_TRANS_TYPE_SIZE)) << SMARTIO_TRANS_TYPE_OFS);
-  buf->transport_header |= (t && MY_SIZE2MASK(SMARTIO_TRANS_TYPE_SIZE)) << SMARTIO_TRANS_TYPE_OFS;
+  buf->transport_header &= ~(MY_SIZE2MASK(SMARTIO_TRANS_TYPE_SIZE) << SMARTIO_TRANS_TYPE_OFS);
+  buf->transport_header |= (t & MY_SIZE2MASK(SMARTIO_TRANS_TYPE_SIZE)) << SMARTIO_TRANS_TYPE_OFS;
 }
 
 
@@ -18,8 +18,8 @@ inline int smartio_get_msg_type(struct smartio_comm_buf* buf)
 
 inline void smartio_set_direction(struct smartio_comm_buf* buf, int d)
 {
-  buf->transport_header &= (~(MY_SIZE2MASK(SMARTIO_TRANS_DIR_SIZE)) << SMARTIO_TRANS_DIR_OFS);
-  buf->transport_header |= (d && MY_SIZE2MASK(SMARTIO_TRANS_DIR_SIZE)) << SMARTIO_TRANS_DIR_OFS;
+  buf->transport_header &= ~(MY_SIZE2MASK(SMARTIO_TRANS_DIR_SIZE) << SMARTIO_TRANS_DIR_OFS);
+  buf->transport_header |= (d & MY_SIZE2MASK(SMARTIO_TRANS_DIR_SIZE)) << SMARTIO_TRANS_DIR_OFS;
 }
 
 
@@ -32,7 +32,7 @@ inline int smartio_get_direction(struct smartio_comm_buf* buf)
 inline void smartio_set_transaction_id(struct smartio_comm_buf* buf, int d)
 {
   buf->transport_header &= ~MY_SIZE2MASK(SMARTIO_TRANS_ID_SIZE);
-  buf->transport_header |= d && MY_SIZE2MASK(SMARTIO_TRANS_ID_SIZE);
+  buf->transport_header |= d & MY_SIZE2MASK(SMARTIO_TRANS_ID_SIZE);
 }
 
 
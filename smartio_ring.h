@@ -0,0 +1,37 @@
+#ifndef __SMARTIO_RING_H__
+#define __SMARTIO_RING_H__
+
+/* Shared by the driver and user space. */
+#include <linux/types.h>
+
+/* Stream ring of a function char device opened for reading. mmap()
+   of the device maps, by page offset:
+   SMARTIO_RING_HDR_PAGE: struct smartio_ring_hdr, read only
+   SMARTIO_RING_TAIL_PAGE: struct smartio_ring_tail. The only page
+     which may be mapped writable (MAP_SHARED), and then on its own.
+   From data_offset on: the data, read only.
+   The driver appends to the ring as the node is polled and advances
+   head; the reader consumes and advances tail. Both are free running
+   byte counts, so the number of bytes in the ring is head - tail, and
+   byte n is at data[n & (size - 1)].
+   A reader must read head before the data, and write tail after it
+   is done with the data. A tail more than size behind head, or ahead
+   of it, is taken as size behind; the reader then gets stale data.
+   When the ring is full, new data is dropped and counted in overruns.
+   read() consumes from the same ring. */
+#define SMARTIO_RING_HDR_PAGE 0
+#define SMARTIO_RING_TAIL_PAGE 1
+
+struct smartio_ring_hdr {
+  __u32 size;        /* Bytes in the data area, a power of two */
+  __u32 data_offset; /* Where the data area starts in the mapping */
+  __u32 tail_offset; /* Where struct smartio_ring_tail is */
+  __u32 overruns;    /* Bytes dropped since open */
+  __u32 head;        /* Written by the driver */
+};
+
+struct smartio_ring_tail {
+  __u32 tail;        /* Written by the reader */
+};
+
+#endif
@@ -2,107 +2,187 @@
 #include "txbuf_list.h"
 #include "comm_buf.h"
 
-#define TRANS_ID_BITS (1  << SMARTIO_TRANS_ID_SIZE)
-static DECLARE_BITMAP(transId, TRANS_ID_BITS);
-static DEFINE_MUTEX(tx_lock);
-static LIST_HEAD(transactions);
 
+/* First ID from next on, wrapping around, whose bit is clear */
+static int findFreeId(const unsigned long *busy, int next)
+{
+  int id = find_next_zero_bit(busy, TRANS_ID_BITS, next);
 
+  if (id == TRANS_ID_BITS)
+    id = find_first_zero_bit(busy, TRANS_ID_BITS);
+  return id;
+}
 
-static int getTransId(void)
+/* Called with the table lock held */
+static int getTransId(struct smartio_trans_table *table)
 {
+  DECLARE_BITMAP(busy, TRANS_ID_BITS);
   int newId;
+  int id;
 
-  newId = find_first_zero_bit(transId, TRANS_ID_BITS);
-
-  if (newId == TRANS_ID_BITS)
-  {
-    // No free IDs
-    pr_err("There are no free transaction IDs\n");
-    return -1;
+  if (table->in_flight >= table->window)
+    return -EBUSY;
+
+  /* Stale IDs which have waited a full cycle are free again */
+  for_each_set_bit(id, table->stale, TRANS_ID_BITS)
+    if (table->issued - table->stale_at[id] >= TRANS_ID_BITS)
+      clear_bit(id, table->stale);
+
+  bitmap_or(busy, table->transId, table->stale, TRANS_ID_BITS);
+  newId = findFreeId(busy, table->next);
+  if (newId == TRANS_ID_BITS) {
+    /* Better a stale ID than a stalled node */
+    newId = findFreeId(table->transId, table->next);
+    if (newId == TRANS_ID_BITS)
+      return -EBUSY;
+    clear_bit(newId, table->stale);
   }
-  set_bit(newId, transId);
+  set_bit(newId, table->transId);
+  table->in_flight++;
+  table->issued++;
+  table->next = (newId + 1) % TRANS_ID_BITS;
  
   return newId;
 }
 
-static int releaseTransId(int id)
+/* Called with the table lock held */
+static int releaseTransId(struct smartio_trans_table *table, int id)
 {
   int status = id;
 
-  if (!test_and_clear_bit(id, transId)) {
+  if (!test_and_clear_bit(id, table->transId)) {
     // This transaction ID was not claimed.
     pr_err("Trying to release unclaimed transaction ID %d\n", id);
     status = -1;
   }
+  else
+    table->in_flight--;
 
   return status;
 }
 
 
-/* TBD: add checking for id claim success */
-int smartio_add_transaction(struct smartio_comm_buf *comm_buf)
+void smartio_init_transactions(struct smartio_trans_table *table, int window)
 {
-  int id;
+  spin_lock_init(&table->lock);
+  table->in_flight = 0;
+  table->next = 0;
+  table->issued = 0;
+  bitmap_zero(table->transId, TRANS_ID_BITS);
+  bitmap_zero(table->stale, TRANS_ID_BITS);
+  memset(table->slot, 0, sizeof table->slot);
+  smartio_set_window(table, window);
+}
+
 
-  mutex_lock(&tx_lock);
-  id = getTransId();
-  smartio_set_transaction_id(comm_buf, id);
-  list_add_tail(&comm_buf->list, &transactions);
-  mutex_unlock(&tx_lock);
-  return 0;
+/* Set the number of requests that may be outstanding at once.
+   The window is clamped to the range of the transaction ID.
+   Returns the window actually used. */
+int smartio_set_window(struct smartio_trans_table *table, int window)
+{
+  table->window = clamp(window, 1, TRANS_ID_BITS);
+  return table->window;
 }
 
 
+/* Claim a free transaction ID of the node and store the request in
+   the slot for that ID.
+   Returns the ID, or -EBUSY if the window of the node is full. */
+int smartio_add_transaction(struct smartio_node *node,
+			    struct smartio_comm_buf *comm_buf)
+{
+  struct smartio_trans_table *table = &node->transactions;
+  unsigned long flags;
+  int id;
 
+  spin_lock_irqsave(&table->lock, flags);
+  id = getTransId(table);
+  if (id >= 0) {
+    smartio_set_transaction_id(comm_buf, id);
+    table->slot[id] = comm_buf;
+  }
+  spin_unlock_irqrestore(&table->lock, flags);
+
+  return id;
+}
 
 
-struct smartio_comm_buf *smartio_find_transaction(int respId)
+/* Look up the request matching a response, and release its
+   transaction ID. Returns NULL if no such request is outstanding. */
+struct smartio_comm_buf *smartio_find_transaction(struct smartio_node *node,
+						  int respId)
 {
-  struct smartio_comm_buf *req;
-  struct smartio_comm_buf *next;
-  struct smartio_comm_buf *result = NULL;
+  struct smartio_trans_table *table = &node->transactions;
+  struct smartio_comm_buf *result;
+  unsigned long flags;
 
-#ifdef DBG_TRANS
-  pr_info("Entering %s\n", __FUNCTION__);
-#endif
-  mutex_lock(&tx_lock);
-#ifdef DBG_TRANS
-  pr_info("Mutex has been claimed\n");
-#endif
-  if (list_empty(&transactions)) {
-    pr_err("No transactions in list!\n");
+  if ((respId < 0) || (respId >= TRANS_ID_BITS))
     return NULL;
+
+  spin_lock_irqsave(&table->lock, flags);
+  result = table->slot[respId];
+  if (result) {
+    table->slot[respId] = NULL;
+    releaseTransId(table, respId);
   }
+  else
+    /* The late answer of a timed out request; the ID is safe again */
+    clear_bit(respId, table->stale);
+  spin_unlock_irqrestore(&table->lock, flags);
 
-  list_for_each_entry_safe(req, next, &transactions, list) {
 #ifdef DBG_TRANS
-    pr_info("Inspecting an item in the transaction queue\n");
-    pr_info("Type: %d\n", smartio_get_msg_type(req));
+  if (!result)
+    pr_info("No outstanding request with transaction ID %d\n", respId);
 #endif
-    if (smartio_get_msg_type(req) == SMARTIO_REQUEST) {
-      int reqId = smartio_get_transaction_id(req);
+  return result;
+}
 
-#ifdef DBG_TRANS
-      pr_info("Found a request in the transaction queue\n");
-#endif
-      if (reqId == respId) {
-#ifdef DBG_TRANS
-	pr_info("Matching transaction ID %d\n", respId);
-#endif
-	list_del(&req->list);
-        releaseTransId(respId);
-	result = req;
-	break;
-      }
-      else {
-#ifdef DBG_TRANS
-	pr_debug("Transaction ID mismatch. Resp: %d, Req: %d\n", respId, reqId);
-#endif
-      }
+
+/* Reclaim the transaction ID of a request which is still outstanding,
+   e.g. because it timed out. The node may still answer it, so the ID
+   is held back for a while. Returns false if the request is no longer
+   in the table. */
+bool smartio_remove_transaction(struct smartio_node *node,
+				struct smartio_comm_buf *comm_buf)
+{
+  struct smartio_trans_table *table = &node->transactions;
+  int id = smartio_get_transaction_id(comm_buf);
+  bool found = false;
+  unsigned long flags;
+
+  spin_lock_irqsave(&table->lock, flags);
+  if (table->slot[id] == comm_buf) {
+    table->slot[id] = NULL;
+    releaseTransId(table, id);
+    set_bit(id, table->stale);
+    table->stale_at[id] = table->issued;
+    found = true;
+  }
+  spin_unlock_irqrestore(&table->lock, flags);
+
+  return found;
+}
+
+
+/* Take any outstanding request off the table, e.g. to fail it when
+   the node goes away. Returns NULL once the table is empty. */
+struct smartio_comm_buf *smartio_take_transaction(struct smartio_node *node)
+{
+  struct smartio_trans_table *table = &node->transactions;
+  struct smartio_comm_buf *result = NULL;
+  unsigned long flags;
+  int id;
+
+  spin_lock_irqsave(&table->lock, flags);
+  for_each_set_bit(id, table->transId, TRANS_ID_BITS) {
+    result = table->slot[id];
+    if (result) {
+      table->slot[id] = NULL;
+      releaseTransId(table, id);
+      break;
     }
   }
+  spin_unlock_irqrestore(&table->lock, flags);
 
-  mutex_unlock(&tx_lock);
   return result;
 }
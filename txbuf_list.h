@@ -1,8 +1,44 @@
 #ifndef __TXBUF_LIST_H__
 #define __TXBUF_LIST_H__
 
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
 
-struct smartio_comm_buf *smartio_find_transaction(int respId);
-int smartio_add_transaction(struct smartio_comm_buf *comm_buf);
+#include "comm_buf.h"
+
+#define TRANS_ID_BITS (1  << SMARTIO_TRANS_ID_SIZE)
+
+/* Outstanding requests of one node, indexed directly by transaction ID.
+   Each node owns its own table, so nodes never compete for IDs
+   or for the lock.
+   At most window requests are outstanding at the same time.
+   IDs are handed out in turn, and the ID of a request which timed out
+   is held back until TRANS_ID_BITS others have been handed out, or
+   its late answer has arrived. A late answer can then not be taken
+   for the answer to a newer request with the same ID. */
+struct smartio_trans_table {
+  spinlock_t lock;
+  int window;
+  int in_flight;
+  int next; /* Where the search for a free ID starts */
+  unsigned int issued; /* IDs handed out so far */
+  DECLARE_BITMAP(transId, TRANS_ID_BITS);
+  DECLARE_BITMAP(stale, TRANS_ID_BITS); /* Timed out, may still be answered */
+  unsigned int stale_at[TRANS_ID_BITS]; /* issued when the ID went stale */
+  struct smartio_comm_buf *slot[TRANS_ID_BITS];
+};
+
+struct smartio_node;
+
+void smartio_init_transactions(struct smartio_trans_table *table, int window);
+int smartio_set_window(struct smartio_trans_table *table, int window);
+struct smartio_comm_buf *smartio_find_transaction(struct smartio_node *node,
+						  int respId);
+int smartio_add_transaction(struct smartio_node *node,
+			    struct smartio_comm_buf *comm_buf);
+bool smartio_remove_transaction(struct smartio_node *node,
+				struct smartio_comm_buf *comm_buf);
+struct smartio_comm_buf *smartio_take_transaction(struct smartio_node *node);
 
 #endif